@@ -0,0 +1,97 @@
+#include "arena.h"
+#include "cage.h"
+#include "object.h"
+#include "vm.h"
+
+const size_t ARENA_REGION_SIZE = 4 * 1024 * 1024;
+const size_t ARENA_ALIGNMENT = 16;
+const size_t ARENA_PAGE_SIZE = 64 * 1024;
+
+typedef struct ArenaRegion {
+    struct ArenaRegion* next;
+    size_t size;
+    size_t used;
+} ArenaRegion;
+
+static ArenaRegion* regions = NULL;
+static size_t bytesReserved = 0;
+
+static size_t alignUp(size_t size, size_t alignment) {
+    return (size + alignment - 1) & ~(alignment - 1);
+}
+
+static ArenaRegion* newRegion(size_t minimum) {
+    size_t needed = alignUp(alignUp(sizeof(ArenaRegion), ARENA_ALIGNMENT) + minimum, ARENA_PAGE_SIZE);
+    size_t remaining = vm.arenaLimit > bytesReserved ? vm.arenaLimit - bytesReserved : 0;
+    size_t size = ARENA_REGION_SIZE < remaining ? ARENA_REGION_SIZE : remaining & ~(ARENA_PAGE_SIZE - 1);
+    if (size < needed) {
+        size = needed;
+    }
+    if (bytesReserved + size > vm.arenaLimit) {
+        return NULL;
+    }
+
+    void* mapping = cageReserve(size);
+    if (mapping == NULL) {
+        return NULL;
+    }
+
+    ArenaRegion* region = (ArenaRegion*) mapping;
+    region->next = regions;
+    region->size = size;
+    region->used = alignUp(sizeof(ArenaRegion), ARENA_ALIGNMENT);
+    regions = region;
+    bytesReserved += size;
+    return region;
+}
+
+// Bump allocates from the newest region. Returns NULL once the configured
+// vm.arenaLimit would be exceeded so the caller can pick a fallback.
+void* arenaAllocate(size_t size) {
+    size = alignUp(size, ARENA_ALIGNMENT);
+    if (regions == NULL || regions->used + size > regions->size) {
+        if (newRegion(size) == NULL) {
+            return NULL;
+        }
+    }
+
+    void* result = (char*) regions + regions->used;
+    regions->used += size;
+    return result;
+}
+
+bool arenaContains(void* pointer) {
+    for (ArenaRegion* region = regions; region != NULL; region = region->next) {
+        char* start = (char*) region;
+        if ((char*) pointer >= start && (char*) pointer < start + region->size) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Objects are laid out back to back, so each region is walked by stepping over
+// objectSize() bytes. Objects released after a fallback to the collector keep
+// their header type and are skipped.
+void arenaForEachObject(ObjectVisitor visit, void* context) {
+    size_t start = alignUp(sizeof(ArenaRegion), ARENA_ALIGNMENT);
+    for (ArenaRegion* region = regions; region != NULL; region = region->next) {
+        for (size_t offset = start; offset < region->used;) {
+            Obj* object = (Obj*) ((char*) region + offset);
+            offset += alignUp(objectSize(object), ARENA_ALIGNMENT);
+            if (object->isAllocated) {
+                visit(object, context);
+            }
+        }
+    }
+}
+
+size_t arenaBytesReserved() {
+    return bytesReserved;
+}
+
+void freeArena() {
+    // The regions live in the cage and are unmapped along with it.
+    regions = NULL;
+    bytesReserved = 0;
+}
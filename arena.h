@@ -0,0 +1,10 @@
+#pragma once
+
+#include "common.h"
+#include "cage.h"
+
+void* arenaAllocate(size_t size);
+bool arenaContains(void* pointer);
+void arenaForEachObject(ObjectVisitor visit, void* context);
+size_t arenaBytesReserved();
+void freeArena();
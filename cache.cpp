@@ -0,0 +1,382 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "loaded.h"
+#include "memory.h"
+#include "vm.h"
+
+// The file is a header, then every string the functions refer to, then the
+// functions with nested ones ahead of those that contain them, so the script
+// comes last. Everything refers to strings and functions by index. Each block
+// is padded to four bytes and each constant table starts on eight, so line
+// tables and constants can be read in place from the mapping. payloadHash
+// covers everything after the header. Upvalue descriptors are not saved; they
+// are read back from the code like VMData's.
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t sourceHash;
+    uint64_t sourceLength;
+    uint64_t payloadHash;
+    uint32_t stringCount;
+    uint32_t functionCount;
+} CacheHeader;
+
+typedef struct {
+    int32_t name;
+    int32_t arity;
+    int32_t upvalueCount;
+    int32_t thisEscapes;
+    int32_t codeLength;
+    int32_t lineCount;
+    int32_t constantCount;
+} CachedFunction;
+
+typedef enum {
+    CACHED_NIL,
+    CACHED_BOOL,
+    CACHED_NUMBER,
+    CACHED_STRING,
+    CACHED_FUNCTION
+} CachedValueType;
+
+typedef struct {
+    int32_t type;
+    int32_t index;
+    double number;
+} CachedValue;
+static_assert(sizeof(CacheHeader) % alignof(CachedValue) == 0, "Constants would be misaligned.");
+
+const char CACHE_MAGIC[4] = {'L', 'O', 'X', 'C'};
+
+static void* mapping = NULL;
+static size_t mappingSize = 0;
+
+static uint64_t hashBytes(const char* chars, size_t length) {
+    uint64_t hash = 14695981039346656037ull ^ (uint64_t) length;
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, chars + i, sizeof(word));
+        hash = (hash ^ word) * 0x9e3779b97f4a7c15ull;
+        hash ^= hash >> 32;
+    }
+    for (; i < length; i++) {
+        hash = (hash ^ (uint8_t) chars[i]) * 0x9e3779b97f4a7c15ull;
+    }
+    return hash;
+}
+
+static size_t padding(size_t size, size_t alignment) {
+    return (alignment - size % alignment) % alignment;
+}
+
+static std::string cachePath(const char* path) {
+    return std::string(path) + "c";
+}
+
+// bytes collects everything after the header, which can only be written once
+// it has been hashed.
+typedef struct {
+    std::vector<ObjFunction*> functions;
+    std::unordered_map<ObjFunction*, int> functionIndex;
+    std::vector<ObjString*> strings;
+    std::unordered_map<ObjString*, int> stringIndex;
+    std::vector<uint8_t> bytes;
+} CacheWriter;
+
+static int addString(CacheWriter* writer, ObjString* string) {
+    auto found = writer->stringIndex.find(string);
+    if (found != writer->stringIndex.end()) {
+        return found->second;
+    }
+    int index = (int) writer->strings.size();
+    writer->strings.push_back(string);
+    writer->stringIndex[string] = index;
+    return index;
+}
+
+static void addFunction(CacheWriter* writer, ObjFunction* function) {
+    if (writer->functionIndex.count(function) > 0) {
+        return;
+    }
+    ValueArray* constants = &function->chunk.constants;
+    for (int i = 0; i < constants->count; i++) {
+        if (isObj(constants->values[i]) && isFunction(constants->values[i])) {
+            addFunction(writer, (ObjFunction*) asObj(constants->values[i]));
+        }
+    }
+    if (function->name != NULL) {
+        addString(writer, function->name);
+    }
+    for (int i = 0; i < constants->count; i++) {
+        if (isObj(constants->values[i]) && isString(constants->values[i])) {
+            addString(writer, asString(constants->values[i]));
+        }
+    }
+    writer->functionIndex[function] = (int) writer->functions.size();
+    writer->functions.push_back(function);
+}
+
+static void write(CacheWriter* writer, const void* data, size_t size) {
+    writer->bytes.insert(writer->bytes.end(), (const uint8_t*) data, (const uint8_t*) data + size);
+}
+
+static void writePadded(CacheWriter* writer, const void* data, size_t size) {
+    write(writer, data, size);
+    writer->bytes.resize(writer->bytes.size() + padding(size, 4), 0);
+}
+
+// The header's size is a multiple of eight, so an offset into bytes is
+// aligned whenever the matching offset in the file is.
+static void writeAlignment(CacheWriter* writer, size_t alignment) {
+    writer->bytes.resize(writer->bytes.size() + padding(writer->bytes.size(), alignment), 0);
+}
+
+static CachedValue cacheValue(CacheWriter* writer, Value value) {
+    CachedValue cached;
+    cached.type = CACHED_NIL;
+    cached.index = 0;
+    cached.number = 0;
+    if (isBool(value)) {
+        cached.type = CACHED_BOOL;
+        cached.index = asBool(value);
+    } else if (isNumber(value)) {
+        cached.type = CACHED_NUMBER;
+        cached.number = asNumber(value);
+    } else if (isObj(value) && isString(value)) {
+        cached.type = CACHED_STRING;
+        cached.index = writer->stringIndex[asString(value)];
+    } else if (isObj(value) && isFunction(value)) {
+        cached.type = CACHED_FUNCTION;
+        cached.index = writer->functionIndex[(ObjFunction*) asObj(value)];
+    }
+    return cached;
+}
+
+// Written to a temporary file and renamed into place so a run that loads the
+// cache never sees half of one. Failing to write it is not an error.
+void writeBytecodeCache(const char* path, Source* source, ObjFunction* script) {
+    CacheWriter writer;
+    addFunction(&writer, script);
+
+    for (ObjString* string : writer.strings) {
+        int32_t length = string->length;
+        write(&writer, &length, sizeof(length));
+        writePadded(&writer, string->chars, string->length);
+    }
+
+    for (ObjFunction* function : writer.functions) {
+        CachedFunction cached;
+        cached.name = function->name != NULL ? writer.stringIndex[function->name] : -1;
+        cached.arity = function->arity;
+        cached.upvalueCount = function->upvalueCount;
+        cached.thisEscapes = function->thisEscapes;
+        cached.codeLength = function->chunk.count;
+        cached.lineCount = function->chunk.lineCount;
+        cached.constantCount = function->chunk.constants.count;
+        write(&writer, &cached, sizeof(cached));
+        writePadded(&writer, function->chunk.code, function->chunk.count);
+        write(&writer, function->chunk.lines, sizeof(LineStart) * function->chunk.lineCount);
+        writeAlignment(&writer, alignof(CachedValue));
+        for (int i = 0; i < function->chunk.constants.count; i++) {
+            CachedValue value = cacheValue(&writer, function->chunk.constants.values[i]);
+            write(&writer, &value, sizeof(value));
+        }
+    }
+
+    CacheHeader header;
+    memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+    header.version = BYTECODE_VERSION;
+    header.sourceHash = hashBytes(source->chars, source->length);
+    header.sourceLength = source->length;
+    header.payloadHash = hashBytes((const char*) writer.bytes.data(), writer.bytes.size());
+    header.stringCount = (uint32_t) writer.strings.size();
+    header.functionCount = (uint32_t) writer.functions.size();
+
+    std::string target = cachePath(path);
+    std::string temporary = target + ".tmp";
+    FILE* file = fopen(temporary.c_str(), "wb");
+    if (file == NULL) {
+        return;
+    }
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(writer.bytes.data(), 1, writer.bytes.size(), file);
+    bool failed = ferror(file) != 0;
+    if (fclose(file) != 0 || failed || rename(temporary.c_str(), target.c_str()) != 0) {
+        remove(temporary.c_str());
+    }
+}
+
+typedef struct {
+    const uint8_t* start;
+    const uint8_t* cursor;
+    const uint8_t* end;
+} CacheReader;
+
+// Returns the next size bytes of the file and steps over them and padding to
+// alignment, or NULL if the file is too short.
+static const uint8_t* take(CacheReader* reader, size_t size, size_t alignment) {
+    size_t padded = size + padding(size, alignment);
+    if ((size_t) (reader->end - reader->cursor) < padded) {
+        return NULL;
+    }
+    const uint8_t* result = reader->cursor;
+    reader->cursor += padded;
+    return result;
+}
+
+static bool skipAlignment(CacheReader* reader, size_t alignment) {
+    return take(reader, padding(reader->cursor - reader->start, alignment), 1) != NULL;
+}
+
+static bool readValue(const CachedValue* cached, uint32_t stringCount, int functionCount, Value* value) {
+    switch (cached->type) {
+        case CACHED_NIL:
+            *value = nilVal();
+            return true;
+        case CACHED_BOOL:
+            *value = boolVal(cached->index != 0);
+            return true;
+        case CACHED_NUMBER:
+            *value = numberVal(cached->number);
+            return true;
+        case CACHED_STRING:
+            if (cached->index < 0 || (uint32_t) cached->index >= stringCount) {
+                return false;
+            }
+            *value = loaded.values[cached->index];
+            return true;
+        case CACHED_FUNCTION:
+            // Nested functions come first, so only earlier ones can be named.
+            if (cached->index < 0 || cached->index >= functionCount) {
+                return false;
+            }
+            *value = loaded.values[stringCount + cached->index];
+            return true;
+    }
+    return false;
+}
+
+static ObjFunction* readFunctions(CacheReader* reader, const CacheHeader* header) {
+    for (uint32_t i = 0; i < header->stringCount; i++) {
+        const int32_t* length = (const int32_t*) take(reader, sizeof(int32_t), 1);
+        if (length == NULL || *length < 0) {
+            return NULL;
+        }
+        const char* chars = (const char*) take(reader, *length, 4);
+        if (chars == NULL) {
+            return NULL;
+        }
+        keepLoaded(objVal((Obj*) copyString(chars, *length)));
+    }
+
+    ObjFunction* function = NULL;
+    for (uint32_t i = 0; i < header->functionCount; i++) {
+        const CachedFunction* cached = (const CachedFunction*) take(reader, sizeof(CachedFunction), 1);
+        if (cached == NULL || cached->codeLength < 0 || cached->lineCount < 0 || cached->constantCount < 0
+                || cached->upvalueCount < 0 || cached->upvalueCount > UINT8_COUNT
+                || cached->name >= (int32_t) header->stringCount) {
+            return NULL;
+        }
+        const uint8_t* code = take(reader, cached->codeLength, 4);
+        const LineStart* lines = (const LineStart*) take(reader, sizeof(LineStart) * cached->lineCount, 1);
+        if (code == NULL || lines == NULL || !skipAlignment(reader, alignof(CachedValue))) {
+            return NULL;
+        }
+        const CachedValue* constants = (const CachedValue*) take(reader,
+            sizeof(CachedValue) * cached->constantCount, 1);
+        if (constants == NULL) {
+            return NULL;
+        }
+
+        function = newFunction();
+        keepLoaded(objVal((Obj*) function));
+        function->name = cached->name >= 0 ? asString(loaded.values[cached->name]) : NULL;
+        function->arity = cached->arity;
+        function->thisEscapes = cached->thisEscapes != 0;
+        allocateUpvalues(function, cached->upvalueCount);
+        // Capacities of zero tell freeChunk() the code and lines aren't ours
+        // to free.
+        function->chunk.code = (uint8_t*) code;
+        function->chunk.count = cached->codeLength;
+        function->chunk.lines = (LineStart*) lines;
+        function->chunk.lineCount = cached->lineCount;
+        for (int j = 0; j < cached->constantCount; j++) {
+            Value value;
+            if (!readValue(&constants[j], header->stringCount, i, &value)) {
+                return NULL;
+            }
+            writeValueArray(&function->chunk.constants, value);
+        }
+        // Nested functions come first, so the ones this creates are complete.
+        if (!describeUpvalues(function)) {
+            return NULL;
+        }
+    }
+    return function;
+}
+
+// Returns the script function from path's cache, or NULL when there is no
+// cache or it was made from a different source or by a different VM.
+ObjFunction* loadBytecodeCache(const char* path, Source* source) {
+    int fd = open(cachePath(path).c_str(), O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t) info.st_size < sizeof(CacheHeader)) {
+        close(fd);
+        return NULL;
+    }
+    size_t size = (size_t) info.st_size;
+    void* file = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED) {
+        return NULL;
+    }
+
+    CacheReader reader;
+    reader.start = (const uint8_t*) file;
+    reader.cursor = reader.start;
+    reader.end = reader.start + size;
+    const CacheHeader* header = (const CacheHeader*) take(&reader, sizeof(CacheHeader), 1);
+    if (memcmp(header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0
+            || header->version != BYTECODE_VERSION
+            || header->sourceLength != source->length
+            || header->sourceHash != hashBytes(source->chars, source->length)
+            || header->payloadHash != hashBytes((const char*) reader.cursor, reader.end - reader.cursor)
+            || header->functionCount == 0) {
+        munmap(file, size);
+        return NULL;
+    }
+
+    initValueArray(&loaded);
+    ObjFunction* script = readFunctions(&reader, header);
+    freeValueArray(&loaded);
+    if (script == NULL) {
+        // Whatever was made is garbage now and nothing points into the file.
+        munmap(file, size);
+        return NULL;
+    }
+    mapping = file;
+    mappingSize = size;
+    return script;
+}
+
+void closeBytecodeCache() {
+    if (mapping != NULL) {
+        munmap(mapping, mappingSize);
+        mapping = NULL;
+        mappingSize = 0;
+    }
+}
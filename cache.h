@@ -0,0 +1,13 @@
+#pragma once
+
+#include "common.h"
+#include "object.h"
+#include "source.h"
+
+// A compiled script saved next to its source as <path>c, e.g. a.lox ->
+// a.loxc. It is keyed by a hash of the source text and BYTECODE_VERSION.
+// Loaded functions keep their code and line tables in the mapped file, so
+// the mapping stays open until closeBytecodeCache().
+ObjFunction* loadBytecodeCache(const char* path, Source* source);
+void writeBytecodeCache(const char* path, Source* source, ObjFunction* script);
+void closeBytecodeCache();
@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include "cage.h"
+#include "object.h"
+
+const size_t CAGE_MAX_SIZE = COMPRESSED_POINTERS
+    ? (size_t) 4 * 1024 * 1024 * 1024
+    : (size_t) 64 * 1024 * 1024 * 1024;
+const size_t CAGE_MIN_SIZE = (size_t) 64 * 1024 * 1024;
+const size_t CAGE_PAGE_SIZE = 64 * 1024;
+// Pages are made writable this many at a time when the cage is opened in steps.
+const size_t CAGE_COMMIT_PAGES = 16;
+const size_t CAGE_ALIGNMENT = 16;
+const size_t CAGE_SMALL_LIMIT = 256;
+const int CAGE_SMALL_CLASSES = CAGE_SMALL_LIMIT / CAGE_ALIGNMENT;
+const int CAGE_CLASS_COUNT = CAGE_SMALL_CLASSES + 24;
+
+// What each page of the cage holds. Pages of a size class are cut into equal
+// slots, so walking them only needs the slot size.
+const uint8_t PAGE_UNUSED = 0;
+const uint8_t PAGE_CONTINUATION = 254;
+const uint8_t PAGE_FOREIGN = 255;
+
+// Freed slots keep a zeroed header in front of the link so walking the
+// page sees them as unallocated.
+typedef struct FreeBlock {
+    uint64_t header;
+    struct FreeBlock* next;
+} FreeBlock;
+
+uint8_t* cageBase = NULL;
+static size_t cageSize = 0;
+static size_t pageCount = 0;
+static size_t pagesUsed = 0;
+static size_t pagesCommitted = 0;
+static uint8_t* pageKinds = NULL;
+static FreeBlock* freeLists[CAGE_CLASS_COUNT];
+static uint8_t* classCursor[CAGE_CLASS_COUNT];
+static uint8_t* classLimit[CAGE_CLASS_COUNT];
+
+// Small objects get 16 byte steps, anything bigger is rounded up to a power
+// of two so freed blocks can be reused by later allocations of the same class.
+static int sizeClass(size_t size) {
+    if (size <= CAGE_SMALL_LIMIT) {
+        return (int) ((size + CAGE_ALIGNMENT - 1) / CAGE_ALIGNMENT) - 1;
+    }
+    int index = CAGE_SMALL_CLASSES;
+    size_t classSize = CAGE_SMALL_LIMIT * 2;
+    while (classSize < size) {
+        classSize *= 2;
+        index++;
+    }
+    return index;
+}
+
+static size_t classSize(int index) {
+    if (index < CAGE_SMALL_CLASSES) {
+        return (size_t) (index + 1) * CAGE_ALIGNMENT;
+    }
+    return CAGE_SMALL_LIMIT * 2 << (index - CAGE_SMALL_CLASSES);
+}
+
+static size_t pagesFor(size_t size) {
+    return (size + CAGE_PAGE_SIZE - 1) / CAGE_PAGE_SIZE;
+}
+
+// Under strict overcommit a writable reservation counts in full against the
+// commit limit. The cage is then reserved without access and opened up in
+// steps, and pagesCommitted says how far it is open.
+static bool commitPages(size_t count) {
+    if (count > pageCount) {
+        return false;
+    }
+    count = (count + CAGE_COMMIT_PAGES - 1) / CAGE_COMMIT_PAGES * CAGE_COMMIT_PAGES;
+    if (count > pageCount) {
+        count = pageCount;
+    }
+    if (mprotect(cageBase + pagesCommitted * CAGE_PAGE_SIZE, (count - pagesCommitted) * CAGE_PAGE_SIZE,
+            PROT_READ | PROT_WRITE) != 0) {
+        return false;
+    }
+    pagesCommitted = count;
+    return true;
+}
+
+static uint8_t* reservePages(size_t count, uint8_t kind) {
+    if (pagesUsed + count > pagesCommitted && !commitPages(pagesUsed + count)) {
+        return NULL;
+    }
+    pageKinds[pagesUsed] = kind;
+    for (size_t i = 1; i < count; i++) {
+        pageKinds[pagesUsed + i] = PAGE_CONTINUATION;
+    }
+    uint8_t* result = cageBase + pagesUsed * CAGE_PAGE_SIZE;
+    pagesUsed += count;
+    return result;
+}
+
+// Takes at most half of any address space limit, and halves the request
+// until the system grants it. Only compressed references need the cage to be
+// a single 4 GB region, and they work with less.
+static size_t reserveCage() {
+    size_t size = CAGE_MAX_SIZE;
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_AS, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+        while (size > CAGE_MIN_SIZE && size > limit.rlim_cur / 2) {
+            size /= 2;
+        }
+    }
+    for (; size >= CAGE_MIN_SIZE; size /= 2) {
+        void* mapping = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (mapping != MAP_FAILED) {
+            pagesCommitted = size / CAGE_PAGE_SIZE;
+        } else {
+            mapping = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            pagesCommitted = 0;
+        }
+        if (mapping != MAP_FAILED) {
+            cageBase = (uint8_t*) mapping;
+            return size;
+        }
+    }
+    return 0;
+}
+
+void initCage() {
+    if (cageBase != NULL) {
+        return;
+    }
+    cageSize = reserveCage();
+    if (cageSize == 0) {
+        fprintf(stderr, "Could not reserve the heap cage.\n");
+        exit(1);
+    }
+    pageCount = cageSize / CAGE_PAGE_SIZE;
+    pageKinds = (uint8_t*) calloc(pageCount, sizeof(uint8_t));
+    if (pageKinds == NULL) {
+        exit(1);
+    }
+    for (int i = 0; i < CAGE_CLASS_COUNT; i++) {
+        freeLists[i] = NULL;
+        classCursor[i] = NULL;
+        classLimit[i] = NULL;
+    }
+    // The first page is never handed out so that offset 0 can stand for NULL.
+    pagesUsed = 0;
+    reservePages(1, PAGE_FOREIGN);
+}
+
+void freeCage() {
+    if (cageBase == NULL) {
+        return;
+    }
+    munmap(cageBase, cageSize);
+    free(pageKinds);
+    cageBase = NULL;
+    pageKinds = NULL;
+}
+
+bool cageContains(void* pointer) {
+    return cageBase != NULL && (uint8_t*) pointer >= cageBase
+        && (uint8_t*) pointer < cageBase + cageSize;
+}
+
+// Hands out fresh, never used pages that the cage itself will not walk. Used
+// by the arena, which keeps track of its own objects.
+void* cageReserve(size_t size) {
+    return reservePages(pagesFor(size), PAGE_FOREIGN);
+}
+
+void* cageAllocate(size_t size) {
+    int index = sizeClass(size);
+    FreeBlock* block = freeLists[index];
+    if (block != NULL) {
+        freeLists[index] = block->next;
+        block->next = NULL;
+        return block;
+    }
+
+    size_t slot = classSize(index);
+    uint8_t* result;
+    if (slot >= CAGE_PAGE_SIZE) {
+        result = reservePages(pagesFor(slot), (uint8_t) (index + 1));
+    } else {
+        if (classCursor[index] == NULL || classCursor[index] + slot > classLimit[index]) {
+            classCursor[index] = reservePages(1, (uint8_t) (index + 1));
+            classLimit[index] = classCursor[index] + CAGE_PAGE_SIZE;
+        }
+        result = classCursor[index];
+        if (result != NULL) {
+            classCursor[index] += slot;
+        }
+    }
+    if (result == NULL) {
+        fprintf(stderr, "Heap cage exhausted.\n");
+        exit(1);
+    }
+    return result;
+}
+
+void cageFree(void* pointer, size_t size) {
+    int index = sizeClass(size);
+    FreeBlock* block = (FreeBlock*) pointer;
+    block->header = 0;
+    block->next = freeLists[index];
+    freeLists[index] = block;
+}
+
+// Visits every allocated object in the size class pages. The visitor may free
+// the object it is given.
+void cageForEachObject(ObjectVisitor visit, void* context) {
+    for (size_t page = 0; page < pagesUsed; page++) {
+        uint8_t kind = pageKinds[page];
+        if (kind == PAGE_UNUSED || kind == PAGE_CONTINUATION || kind == PAGE_FOREIGN) {
+            continue;
+        }
+        int index = kind - 1;
+        size_t slot = classSize(index);
+        uint8_t* start = cageBase + page * CAGE_PAGE_SIZE;
+        uint8_t* end = slot >= CAGE_PAGE_SIZE ? start + slot : start + CAGE_PAGE_SIZE;
+        // Slots past the bump cursor of a class's current page were never
+        // handed out, which keeps the sweep of a small heap short.
+        if (classCursor[index] > start && classCursor[index] < end) {
+            end = classCursor[index];
+        }
+        for (uint8_t* cursor = start; cursor + slot <= end; cursor += slot) {
+            Obj* object = (Obj*) cursor;
+            if (object->isAllocated) {
+                visit(object, context);
+            }
+        }
+    }
+}
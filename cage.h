@@ -0,0 +1,53 @@
+#pragma once
+
+#include "common.h"
+
+// Every GC-managed object is allocated inside a single reservation, the cage,
+// carved into pages of equally sized slots so the heap can be walked without
+// linking objects together. The cage is up to 64 GB, less when the address
+// space is limited. With LOX_COMPRESSED_POINTERS it is at most 4 GB and a
+// reference can be stored as a 32-bit offset from cageBase. Offset 0 is never
+// handed out and stands for NULL.
+extern uint8_t* cageBase;
+
+struct Obj;
+typedef void (*ObjectVisitor)(struct Obj* object, void* context);
+
+#ifdef LOX_COMPRESSED_POINTERS
+
+template <typename T>
+struct Ref {
+    uint32_t offset;
+
+    Ref() = default;
+    Ref(T* pointer) : offset(pointer == NULL ? 0 : (uint32_t) ((uint8_t*) pointer - cageBase)) {}
+
+    T* get() const {
+        return offset == 0 ? NULL : (T*) (cageBase + offset);
+    }
+    operator T*() const {
+        return get();
+    }
+    template <typename U>
+    explicit operator U*() const {
+        return (U*) get();
+    }
+    T* operator->() const {
+        return get();
+    }
+};
+
+#else
+
+template <typename T>
+using Ref = T*;
+
+#endif
+
+void initCage();
+void freeCage();
+bool cageContains(void* pointer);
+void* cageReserve(size_t size);
+void* cageAllocate(size_t size);
+void cageFree(void* pointer, size_t size);
+void cageForEachObject(ObjectVisitor visit, void* context);
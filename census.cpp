@@ -0,0 +1,489 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "census.h"
+#include "memory.h"
+#include "table.h"
+#include "vm.h"
+
+volatile sig_atomic_t heapDumpRequested = 0;
+
+static const int CENSUS_TOP_COUNT = 10;
+static int heapDumpSequence = 0;
+
+typedef struct {
+    size_t count;
+    size_t bytes;
+} CensusBucket;
+
+typedef struct {
+    std::string description;
+    int count;
+    int tombstones;
+    int capacity;
+    double load;
+} TableSummary;
+
+typedef struct {
+    int from;
+    int to;
+    std::string label;
+} HeapEdge;
+
+static const char* objTypeName(ObjType type) {
+    switch (type) {
+        case OBJ_BOUND_METHOD: return "OBJ_BOUND_METHOD";
+        case OBJ_CLASS: return "OBJ_CLASS";
+        case OBJ_CLOSURE: return "OBJ_CLOSURE";
+        case OBJ_FUNCTION: return "OBJ_FUNCTION";
+        case OBJ_INSTANCE: return "OBJ_INSTANCE";
+        case OBJ_NATIVE: return "OBJ_NATIVE";
+        case OBJ_STRING: return "OBJ_STRING";
+        case OBJ_UPVALUE: return "OBJ_UPVALUE";
+        case OBJ_ROPE: return "OBJ_ROPE";
+    }
+    return "OBJ_UNKNOWN";
+}
+
+// Bytes owned by a single object: its struct plus the arrays it frees in
+// freeObject(), but not the objects it references.
+static size_t shallowSize(Obj* object) {
+    switch (object->type) {
+        case OBJ_BOUND_METHOD:
+            return sizeof(ObjBoundMethod);
+        case OBJ_CLASS:
+            return sizeof(ObjClass) + tableBytes(((ObjClass*) object)->methods.capacity)
+                + tableBytes(((ObjClass*) object)->methodCache.capacity);
+        case OBJ_CLOSURE:
+            return sizeof(ObjClosure) + sizeof(Value) * ((ObjClosure*) object)->upvalueCount;
+        case OBJ_FUNCTION: {
+            Chunk* chunk = &((ObjFunction*) object)->chunk;
+            return sizeof(ObjFunction) + sizeof(uint8_t) * chunk->capacity
+                + sizeof(LineStart) * chunk->lineCapacity
+                + sizeof(Value) * chunk->constants.capacity
+                + sizeof(Upvalue) * ((ObjFunction*) object)->upvalueCount;
+        }
+        case OBJ_INSTANCE:
+            return sizeof(ObjInstance) + tableBytes(((ObjInstance*) object)->fields.capacity);
+        case OBJ_NATIVE:
+            return sizeof(ObjNative);
+        case OBJ_STRING:
+            return sizeof(ObjString) + ((ObjString*) object)->length + 1;
+        case OBJ_UPVALUE:
+            return sizeof(ObjUpvalue);
+        case OBJ_ROPE:
+            return sizeof(ObjRope);
+    }
+    return 0;
+}
+
+static void collectObject(Obj* object, void* context) {
+    ((std::vector<Obj*>*) context)->push_back(object);
+}
+
+static std::vector<Obj*> liveObjects() {
+    std::vector<Obj*> objects;
+    forEachObject(collectObject, &objects);
+    for (int i = 0; i < vm.scopedCount; i++) {
+        objects.push_back((Obj*) &vm.scopedInstances[i]);
+    }
+    return objects;
+}
+
+static std::string describeObject(Obj* object) {
+    switch (object->type) {
+        case OBJ_BOUND_METHOD: {
+            ObjFunction* function = ((ObjBoundMethod*) object)->method->function;
+            return function->name != NULL ? function->name->chars : "<script>";
+        }
+        case OBJ_CLASS:
+            return ((ObjClass*) object)->name->chars;
+        case OBJ_CLOSURE: {
+            ObjFunction* function = ((ObjClosure*) object)->function;
+            return function->name != NULL ? function->name->chars : "<script>";
+        }
+        case OBJ_FUNCTION: {
+            ObjFunction* function = (ObjFunction*) object;
+            return function->name != NULL ? function->name->chars : "<script>";
+        }
+        case OBJ_INSTANCE:
+            return ((ObjInstance*) object)->klass->name->chars;
+        case OBJ_NATIVE:
+            return "<native fn>";
+        case OBJ_STRING: {
+            ObjString* string = (ObjString*) object;
+            std::string text(string->chars, std::min(string->length, 40));
+            for (char& c : text) {
+                if (c == '\n' || c == '\r' || c == '\t') {
+                    c = ' ';
+                }
+            }
+            return text;
+        }
+        case OBJ_UPVALUE:
+            return "upvalue";
+        case OBJ_ROPE:
+            return "rope of " + std::to_string(((ObjRope*) object)->length) + " chars";
+    }
+    return "";
+}
+
+template <typename F>
+static void forEachTableEdge(Table* table, const char* kind, F visit) {
+    Ref<ObjString>* keys = tableKeys(table);
+    Value* values = tableValues(table);
+    for (int i = 0; i < tableSlots(table); i++) {
+        if (!tableSlotInUse(table, i)) {
+            continue;
+        }
+        std::string label = std::string(kind) + " " + keys[i]->chars;
+        visit((Obj*) keys[i], label + " (key)");
+        if (isObj(values[i])) {
+            visit(asObj(values[i]), label);
+        }
+    }
+}
+
+// Mirrors blackenObject() in memory.cpp, but names each reference so the
+// snapshot can show why an object is being kept alive.
+template <typename F>
+static void forEachEdge(Obj* object, F visit) {
+    switch (object->type) {
+        case OBJ_BOUND_METHOD: {
+            ObjBoundMethod* bound = (ObjBoundMethod*) object;
+            if (isObj(bound->receiver)) {
+                visit(asObj(bound->receiver), "receiver");
+            }
+            visit((Obj*) bound->method, "method");
+            break;
+        }
+        case OBJ_CLASS: {
+            ObjClass* klass = (ObjClass*) object;
+            visit((Obj*) klass->name, "name");
+            if (klass->superclass != NULL) {
+                visit((Obj*) klass->superclass, "superclass");
+            }
+            if (klass->initializer != NULL) {
+                visit((Obj*) klass->initializer, "initializer");
+            }
+            forEachTableEdge(&klass->methods, "method", visit);
+            forEachTableEdge(&klass->methodCache, "cached method", visit);
+            break;
+        }
+        case OBJ_CLOSURE: {
+            ObjClosure* closure = (ObjClosure*) object;
+            visit((Obj*) closure->function, "function");
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                if (isObj(closure->upvalues[i])) {
+                    visit(asObj(closure->upvalues[i]), "upvalue[" + std::to_string(i) + "]");
+                }
+            }
+            break;
+        }
+        case OBJ_FUNCTION: {
+            ObjFunction* function = (ObjFunction*) object;
+            if (function->name != NULL) {
+                visit((Obj*) function->name, "name");
+            }
+            for (int i = 0; i < function->chunk.constants.count; i++) {
+                Value constant = function->chunk.constants.values[i];
+                if (isObj(constant)) {
+                    visit(asObj(constant), "constant[" + std::to_string(i) + "]");
+                }
+            }
+            break;
+        }
+        case OBJ_INSTANCE: {
+            ObjInstance* instance = (ObjInstance*) object;
+            visit((Obj*) instance->klass, "class");
+            forEachTableEdge(&instance->fields, "field", visit);
+            break;
+        }
+        case OBJ_UPVALUE: {
+            Value closed = ((ObjUpvalue*) object)->closed;
+            if (isObj(closed)) {
+                visit(asObj(closed), "closed");
+            }
+            break;
+        }
+        case OBJ_ROPE: {
+            ObjRope* rope = (ObjRope*) object;
+            if (rope->flat != NULL) {
+                visit((Obj*) rope->flat, "flat");
+            } else {
+                visit(rope->left, "left");
+                visit(rope->right, "right");
+            }
+            break;
+        }
+        case OBJ_NATIVE:
+        case OBJ_STRING:
+            break;
+    }
+}
+
+template <typename F>
+static void forEachRoot(F visit) {
+    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+        if (isObj(*slot)) {
+            visit(asObj(*slot), "stack[" + std::to_string(slot - vm.stack) + "]");
+        }
+    }
+    for (int i = 0; i < vm.frameCount; i++) {
+        visit((Obj*) vm.frames[i].closure, "frame[" + std::to_string(i) + "]");
+    }
+    for (int i = 0; i < vm.stackTop - vm.stack; i++) {
+        if (vm.openUpvalues[i] != NULL) {
+            visit((Obj*) vm.openUpvalues[i], "open upvalue[" + std::to_string(i) + "]");
+        }
+    }
+    forEachTableEdge(&vm.globals, "global", visit);
+    if (vm.initString != NULL) {
+        visit((Obj*) vm.initString, "initString");
+    }
+}
+
+static void addTableSummary(std::vector<TableSummary>& tables, std::string description, Table* table) {
+    if (table->capacity > 0) {
+        tables.push_back({description, table->count, table->tombstones, table->capacity,
+            tableLoadFactor(table)});
+    }
+}
+
+void printHeapCensus(FILE* out) {
+    collectGarbage();
+
+    CensusBucket byType[OBJ_ROPE + 1] = {};
+    std::map<std::string, CensusBucket> byClass;
+    std::vector<ObjString*> strings;
+    std::vector<TableSummary> tables;
+    size_t totalCount = 0;
+    size_t totalBytes = 0;
+
+    addTableSummary(tables, "vm.globals", &vm.globals);
+    addTableSummary(tables, "vm.strings", &vm.strings);
+
+    for (Obj* object : liveObjects()) {
+        size_t bytes = shallowSize(object);
+        byType[object->type].count++;
+        byType[object->type].bytes += bytes;
+        totalCount++;
+        totalBytes += bytes;
+
+        switch (object->type) {
+            case OBJ_INSTANCE: {
+                ObjInstance* instance = (ObjInstance*) object;
+                CensusBucket& bucket = byClass[instance->klass->name->chars];
+                bucket.count++;
+                bucket.bytes += bytes;
+                addTableSummary(tables, std::string(instance->klass->name->chars) + " instance fields",
+                    &instance->fields);
+                break;
+            }
+            case OBJ_CLASS: {
+                ObjClass* klass = (ObjClass*) object;
+                addTableSummary(tables, std::string(klass->name->chars) + " methods", &klass->methods);
+                addTableSummary(tables, std::string(klass->name->chars) + " method cache",
+                    &klass->methodCache);
+                break;
+            }
+            case OBJ_STRING:
+                strings.push_back((ObjString*) object);
+                break;
+            default:
+                break;
+        }
+    }
+
+    fprintf(out, "== heap census ==\n");
+    fprintf(out, "%-18s %10s %12s\n", "type", "count", "bytes");
+    for (int type = 0; type <= OBJ_ROPE; type++) {
+        if (byType[type].count == 0) {
+            continue;
+        }
+        fprintf(out, "%-18s %10zu %12zu\n", objTypeName((ObjType) type),
+            byType[type].count, byType[type].bytes);
+    }
+    fprintf(out, "%-18s %10zu %12zu\n", "total", totalCount, totalBytes);
+    fprintf(out, "bytesAllocated %zu, next gc at %zu\n", vm.bytesAllocated, vm.nextGC);
+
+    if (!byClass.empty()) {
+        fprintf(out, "== instances by class ==\n");
+        for (auto& [name, bucket] : byClass) {
+            fprintf(out, "%-18s %10zu %12zu\n", name.c_str(), bucket.count, bucket.bytes);
+        }
+    }
+
+    size_t stringCount = std::min(strings.size(), (size_t) CENSUS_TOP_COUNT);
+    std::partial_sort(strings.begin(), strings.begin() + stringCount, strings.end(),
+        [](ObjString* a, ObjString* b) { return a->length > b->length; });
+    fprintf(out, "== largest strings ==\n");
+    for (size_t i = 0; i < stringCount; i++) {
+        fprintf(out, "%10d  \"%s\"\n", strings[i]->length, describeObject((Obj*) strings[i]).c_str());
+    }
+
+    size_t tableCount = std::min(tables.size(), (size_t) CENSUS_TOP_COUNT);
+    std::partial_sort(tables.begin(), tables.begin() + tableCount, tables.end(),
+        [](const TableSummary& a, const TableSummary& b) { return a.capacity > b.capacity; });
+    fprintf(out, "== largest tables ==\n");
+    for (size_t i = 0; i < tableCount; i++) {
+        fprintf(out, "%10zu  %s (%d/%d entries, %d tombstones, load %.2f)\n",
+            tableBytes(tables[i].capacity), tables[i].description.c_str(), tables[i].count,
+            tables[i].capacity, tables[i].tombstones, tables[i].load);
+    }
+}
+
+// Cooper, Harvey and Kennedy's iterative dominator algorithm. Nodes are
+// numbered in reverse postorder from the synthetic root, which is node 0.
+static int intersect(std::vector<int>& idom, std::vector<int>& order, int a, int b) {
+    while (a != b) {
+        while (order[a] > order[b]) {
+            a = idom[a];
+        }
+        while (order[b] > order[a]) {
+            b = idom[b];
+        }
+    }
+    return a;
+}
+
+static void computeRetainedSizes(int nodeCount, std::vector<HeapEdge>& edges,
+        std::vector<size_t>& shallow, std::vector<size_t>& retained, std::vector<int>& idom) {
+    std::vector<std::vector<int>> successors(nodeCount);
+    std::vector<std::vector<int>> predecessors(nodeCount);
+    for (HeapEdge& edge : edges) {
+        successors[edge.from].push_back(edge.to);
+        predecessors[edge.to].push_back(edge.from);
+    }
+
+    std::vector<int> postorder;
+    std::vector<bool> visited(nodeCount, false);
+    std::vector<std::pair<int, size_t>> stack;
+    stack.push_back({0, 0});
+    visited[0] = true;
+    while (!stack.empty()) {
+        auto& [node, next] = stack.back();
+        if (next < successors[node].size()) {
+            int successor = successors[node][next++];
+            if (!visited[successor]) {
+                visited[successor] = true;
+                stack.push_back({successor, 0});
+            }
+        } else {
+            postorder.push_back(node);
+            stack.pop_back();
+        }
+    }
+
+    std::vector<int> reversePostorder(postorder.rbegin(), postorder.rend());
+    std::vector<int> order(nodeCount, -1);
+    for (size_t i = 0; i < reversePostorder.size(); i++) {
+        order[reversePostorder[i]] = (int) i;
+    }
+
+    idom.assign(nodeCount, -1);
+    idom[0] = 0;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t i = 1; i < reversePostorder.size(); i++) {
+            int node = reversePostorder[i];
+            int newIdom = -1;
+            for (int predecessor : predecessors[node]) {
+                if (idom[predecessor] == -1) {
+                    continue;
+                }
+                newIdom = newIdom == -1 ? predecessor : intersect(idom, order, predecessor, newIdom);
+            }
+            if (idom[node] != newIdom) {
+                idom[node] = newIdom;
+                changed = true;
+            }
+        }
+    }
+
+    retained = shallow;
+    for (size_t i = reversePostorder.size() - 1; i > 0; i--) {
+        int node = reversePostorder[i];
+        retained[idom[node]] += retained[node];
+    }
+}
+
+bool dumpHeapSnapshot(const char* path) {
+    collectGarbage();
+
+    FILE* out = fopen(path, "w");
+    if (out == NULL) {
+        fprintf(stderr, "Could not open heap snapshot \"%s\".\n", path);
+        return false;
+    }
+
+    std::unordered_map<Obj*, int> ids;
+    std::vector<Obj*> nodes;
+    nodes.push_back(NULL);
+    for (Obj* object : liveObjects()) {
+        ids[object] = (int) nodes.size();
+        nodes.push_back(object);
+    }
+
+    std::vector<HeapEdge> edges;
+    forEachRoot([&](Obj* target, std::string label) {
+        auto found = ids.find(target);
+        if (found != ids.end()) {
+            edges.push_back({0, found->second, label});
+        }
+    });
+    for (size_t i = 1; i < nodes.size(); i++) {
+        forEachEdge(nodes[i], [&](Obj* target, std::string label) {
+            auto found = ids.find(target);
+            if (found != ids.end()) {
+                edges.push_back({(int) i, found->second, label});
+            }
+        });
+    }
+
+    std::vector<size_t> shallow(nodes.size(), 0);
+    for (size_t i = 1; i < nodes.size(); i++) {
+        shallow[i] = shallowSize(nodes[i]);
+    }
+    std::vector<size_t> retained;
+    std::vector<int> idom;
+    computeRetainedSizes((int) nodes.size(), edges, shallow, retained, idom);
+
+    fprintf(out, "# lox heap snapshot v1\n");
+    fprintf(out, "# node <id> <type> <shallow bytes> <retained bytes> <dominator id> <name>\n");
+    fprintf(out, "# edge <from id> <to id> <label>\n");
+    fprintf(out, "node 0 ROOT 0 %zu -1 (roots)\n", retained[0]);
+    for (size_t i = 1; i < nodes.size(); i++) {
+        fprintf(out, "node %zu %s %zu %zu %d %s\n", i, objTypeName(nodes[i]->type),
+            shallow[i], retained[i], idom[i], describeObject(nodes[i]).c_str());
+    }
+    for (HeapEdge& edge : edges) {
+        fprintf(out, "edge %d %d %s\n", edge.from, edge.to, edge.label.c_str());
+    }
+
+    fclose(out);
+    return true;
+}
+
+static void requestHeapDump(int signal) {
+    heapDumpRequested = 1;
+}
+
+void installHeapDumpSignal() {
+    signal(SIGUSR1, requestHeapDump);
+}
+
+void serviceHeapDumpRequest() {
+    heapDumpRequested = 0;
+    char path[64];
+    snprintf(path, sizeof(path), "heapdump-%d-%d.txt", (int) getpid(), heapDumpSequence++);
+    if (dumpHeapSnapshot(path)) {
+        fprintf(stderr, "Wrote heap snapshot to %s\n", path);
+    }
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <signal.h>
+#include <stdio.h>
+#include "common.h"
+#include "object.h"
+
+extern volatile sig_atomic_t heapDumpRequested;
+
+void printHeapCensus(FILE* out);
+bool dumpHeapSnapshot(const char* path);
+void installHeapDumpSignal();
+void serviceHeapDumpRequest();
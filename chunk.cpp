@@ -1,6 +1,8 @@
 #include <stdlib.h>
+#include <string.h>
 #include "chunk.h"
 #include "memory.h"
+#include "scratch.h"
 #include "vm.h"
 
 void initChunk(Chunk *chunk)
@@ -8,14 +10,42 @@ void initChunk(Chunk *chunk)
     chunk->count = 0;
     chunk->capacity = 0;
     chunk->code = NULL;
+    chunk->lineCount = 0;
+    chunk->lineCapacity = 0;
     chunk->lines = NULL;
     initValueArray(&chunk->constants);
+    chunk->frozen = false;
 }
 
+// The constants start at the first Value boundary after the code.
+static size_t frozenCodeBytes(int count)
+{
+    return (count + alignof(Value) - 1) & ~(alignof(Value) - 1);
+}
+
+static size_t frozenSize(int count, int constantCount, int lineCount)
+{
+    return frozenCodeBytes(count) + sizeof(Value) * constantCount + sizeof(LineStart) * lineCount;
+}
+
+// Chunks loaded from a bytecode cache have a capacity of zero; their code
+// and lines belong to the cache's mapping.
 void freeChunk(Chunk *chunk)
 {
-    freeArray<u_int8_t>(chunk->code, chunk->capacity);
-    freeArray<int>(chunk->lines, chunk->capacity);
+    if (chunk->frozen)
+    {
+        freeArray<uint8_t>(chunk->code, (int) frozenSize(chunk->count, chunk->constants.count, chunk->lineCount));
+        initChunk(chunk);
+        return;
+    }
+    if (chunk->capacity > 0)
+    {
+        freeArray<u_int8_t>(chunk->code, chunk->capacity);
+    }
+    if (chunk->lineCapacity > 0)
+    {
+        freeArray<LineStart>(chunk->lines, chunk->lineCapacity);
+    }
     freeValueArray(&chunk->constants);
     initChunk(chunk);
 }
@@ -26,20 +56,126 @@ void writeChunk(Chunk *chunk, uint8_t byte, int line)
     {
         int oldCapacity = chunk->capacity;
         chunk->capacity = growCapacity(oldCapacity);
-        chunk->code = growArray<u_int8_t>(chunk->code,
-                                          oldCapacity, chunk->capacity);
-        chunk->lines = growArray<int>(chunk->lines, oldCapacity, chunk->capacity);
+        chunk->code = growScratchArray<uint8_t>(chunk->code, oldCapacity, chunk->capacity);
     }
 
     chunk->code[chunk->count] = byte;
-    chunk->lines[chunk->count] = line;
     chunk->count++;
+
+    if (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].line == line)
+    {
+        return;
+    }
+    if (chunk->lineCapacity < chunk->lineCount + 1)
+    {
+        int oldCapacity = chunk->lineCapacity;
+        chunk->lineCapacity = growCapacity(oldCapacity);
+        chunk->lines = growScratchArray<LineStart>(chunk->lines, oldCapacity, chunk->lineCapacity);
+    }
+    chunk->lines[chunk->lineCount].offset = chunk->count - 1;
+    chunk->lines[chunk->lineCount].line = line;
+    chunk->lineCount++;
 }
 
 int addConstant(Chunk *chunk, Value value)
 {
-    push(value);
-    writeValueArray(&chunk->constants, value);
-    pop();
-    return chunk->constants.count - 1;
-}
\ No newline at end of file
+    ValueArray *constants = &chunk->constants;
+    if (constants->capacity < constants->count + 1)
+    {
+        int oldCapacity = constants->capacity;
+        constants->capacity = growCapacity(oldCapacity);
+        constants->values = growScratchArray<Value>(constants->values, oldCapacity, constants->capacity);
+    }
+    constants->values[constants->count] = value;
+    return constants->count++;
+}
+
+// chunk must be empty. The allocation can collect, so from's constants have to
+// be reachable by the collector.
+void freezeChunk(Chunk *chunk, const Chunk *from)
+{
+    uint8_t *block = allocate<uint8_t>((int) frozenSize(from->count, from->constants.count, from->lineCount));
+    Value *constants = (Value *) (block + frozenCodeBytes(from->count));
+    LineStart *lines = (LineStart *) (constants + from->constants.count);
+    if (from->count > 0)
+    {
+        memcpy(block, from->code, from->count);
+    }
+    if (from->constants.count > 0)
+    {
+        memcpy(constants, from->constants.values, sizeof(Value) * from->constants.count);
+    }
+    if (from->lineCount > 0)
+    {
+        memcpy(lines, from->lines, sizeof(LineStart) * from->lineCount);
+    }
+
+    chunk->code = block;
+    chunk->count = from->count;
+    chunk->capacity = from->count;
+    chunk->lines = lines;
+    chunk->lineCount = from->lineCount;
+    chunk->lineCapacity = from->lineCount;
+    chunk->constants.values = constants;
+    chunk->constants.count = from->constants.count;
+    chunk->constants.capacity = from->constants.count;
+    chunk->frozen = true;
+}
+
+// Finds the last run starting at or before offset. Only error reporting and
+// the disassembler need lines, so the search stays off the hot path. Chunks
+// without a line table report line 0.
+int getLine(Chunk *chunk, int offset)
+{
+    int low = 0;
+    int high = chunk->lineCount - 1;
+    int line = 0;
+    while (low <= high)
+    {
+        int mid = low + (high - low) / 2;
+        if (chunk->lines[mid].offset <= offset)
+        {
+            line = chunk->lines[mid].line;
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid - 1;
+        }
+    }
+    return line;
+}
+// Operand bytes that follow an instruction. OP_CLOSURE is followed by two
+// more for each upvalue of the function it creates.
+int operandBytes(uint8_t instruction)
+{
+    switch (instruction)
+    {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_CALL:
+        case OP_CLOSURE:
+        case OP_CLASS:
+        case OP_GET_SUPER:
+        case OP_METHOD:
+        case OP_GET_CAPTURED:
+        case OP_CALL_SCOPED:
+            return 1;
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+            return 2;
+        default:
+            return 0;
+    }
+}
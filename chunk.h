@@ -2,6 +2,10 @@
 #include "common.h"
 #include "value.h"
 
+// Stamped into bytecode caches. Bump it whenever an opcode, its operands or
+// the layout of a cache change.
+const uint32_t BYTECODE_VERSION = 3;
+
 typedef enum
 {
     OP_CONSTANT,
@@ -40,18 +44,34 @@ typedef enum
     OP_INHERIT,
     OP_GET_SUPER,
     OP_SUPER_INVOKE,
-    OP_METHOD
+    OP_METHOD,
+    OP_GET_CAPTURED,
+    OP_CALL_SCOPED,
+    OP_POP_SCOPED
 } OpCode;
 
 // std::string arrayForPrinting[255];
 
+// The bytes from offset up to the next run's offset came from line.
+typedef struct
+{
+    int offset;
+    int line;
+} LineStart;
+
+// Chunks are written while compiling, in scratch memory (see scratch.h), and
+// then frozen: code, constants and lines are copied into one block of exactly
+// the size they need, which starts at code.
 typedef struct
 {
     int count;
     int capacity;
     uint8_t *code;
-    int *lines;
+    int lineCount;
+    int lineCapacity;
+    LineStart *lines;
     ValueArray constants;
+    bool frozen;
 } Chunk;
 
 typedef struct
@@ -63,4 +83,7 @@ typedef struct
 void initChunk(Chunk *chunk);
 void freeChunk(Chunk *chunk);
 void writeChunk(Chunk *chunk, uint8_t byte, int line);
-int addConstant(Chunk *chunk, Value value);
\ No newline at end of file
+void freezeChunk(Chunk *chunk, const Chunk *from);
+int addConstant(Chunk *chunk, Value value);
+int getLine(Chunk *chunk, int offset);
+int operandBytes(uint8_t instruction);
\ No newline at end of file
@@ -6,4 +6,11 @@
 
 const bool DEBUG_STRESS_GC = true;
 const bool DEBUG_LOG_GC = false;
+
+#ifdef LOX_COMPRESSED_POINTERS
+const bool COMPRESSED_POINTERS = true;
+#else
+const bool COMPRESSED_POINTERS = false;
+#endif
+
 const uint16_t UINT8_COUNT = UINT8_MAX + 1;
\ No newline at end of file
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <algorithm>
 #include <vector>
 #include <iostream>
 #include "common.h"
@@ -8,6 +9,7 @@
 #include "scanner.h"
 #include "memory.h"
 #include "debug.h"
+#include "scratch.h"
 
 typedef struct {
     Token current;
@@ -38,10 +40,15 @@ typedef struct {
     Precedence precedence;
 } ParseRule;
 
+// isCaptured is only set for locals captured by reference. isAssigned is -1
+// until a capture asks whether the local is ever written after its declaration.
+// isScoped marks a local initialized by OP_CALL_SCOPED.
 typedef struct {
     Token name;
     int depth;
     bool isCaptured;
+    int8_t isAssigned;
+    bool isScoped;
 } Local;
 
 typedef enum {
@@ -51,15 +58,40 @@ typedef enum {
     TYPE_SCRIPT
 } FunctionType;
 
+// What a function whose body was skipped under lazyCompile needs to compile
+// it on its first call. The enclosing compilers are gone by then, so the
+// names its upvalues were resolved from stand in for them.
+struct LazyFunction {
+    const char* parameters;
+    int line;
+    FunctionType type;
+    bool inClass;
+    bool hasSuperclass;
+    Token* upvalueNames;
+};
+
+// upvalueNames holds the name each upvalue was resolved from. lazy is set on the
+// outermost compiler when compiling a skipped body. chunk is written in
+// scratch memory and frozen into function by endCompiler(). assignedNames
+// lists, sorted, every name assigned to in the body, which starts at body.
+// It is collected in scratch memory by the first capture of one of the
+// function's locals and assignedCount is -1 until then.
 typedef struct Compiler {
     struct Compiler* enclosing;
     ObjFunction* function;
     FunctionType type;
+    Chunk chunk;
+    const char* body;
+    Token* assignedNames;
+    int assignedCount;
+    int assignedCapacity;
 
     Local locals[UINT8_COUNT];
     int localCount;
     Upvalue upvalues[UINT8_COUNT];
+    Token upvalueNames[UINT8_COUNT];
     int scopeDepth;
+    LazyFunction* lazy;
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -68,8 +100,14 @@ typedef struct ClassCompiler {
 } ClassCompiler;
 
 Parser parser;
+const char* sourceStart = NULL;
+const char* sourceEnd = NULL;
 Compiler* current = NULL;
 ClassCompiler* currentClass = NULL;
+bool lazyCompile = false;
+// Off while checkBody() parses a skipped body, which then writes no code,
+// makes no constants and records no functions.
+static bool emitting = true;
 std::vector<ObjFunction*> locationOfFunctions;
 std::unordered_map<uint64_t, std::vector<Upvalue>> locationOfUpvalues;
 std::unordered_map<std::string, std::set<uint64_t>> locationsOfNonInstructions;
@@ -77,7 +115,7 @@ std::unordered_map<std::string, std::set<uint64_t>> locationsOfNonInstructions;
 // Chunk* compilingChunk;
 
 static Chunk* currentChunk() {
-    return &current->function->chunk;
+    return &current->chunk;
 }
 
 static void errorAt(Token* token, const char* message) {
@@ -140,6 +178,9 @@ static bool match(TokenType type) {
 }
 
 static void emitByte(uint8_t byte) {
+    if (!emitting) {
+        return;
+    }
     writeChunk(currentChunk(), byte, parser.previous.line);
 }
 
@@ -149,20 +190,22 @@ static void emitBytes(uint8_t byte1, uint8_t byte2) {
 }
 
 static void insertInstructionsIntoMapSet(int count){
+    if (!emitting) {
+        return;
+    }
     std::string name;
     if (current->function->name == NULL){
         name = "";
     } else{
         name = current->function->name->chars;
     }
-    int index = current->function->chunk.count - 1;
-    // std::cout<< "Printing index: " << index << " and name: " << name << " and address: " <<
-        // (uint64_t) &current->function->chunk.code[index];
+    // Offsets rather than addresses, since the code moves when it is frozen.
+    int index = currentChunk()->count - 1;
     if (count == 1){
-        locationsOfNonInstructions[name].insert((uint64_t) &current->function->chunk.code[index]);
+        locationsOfNonInstructions[name].insert(index);
     } else if (count == 2){
-        locationsOfNonInstructions[name].insert((uint64_t) &current->function->chunk.code[index - 1]);
-        locationsOfNonInstructions[name].insert((uint64_t) &current->function->chunk.code[index]);
+        locationsOfNonInstructions[name].insert(index - 1);
+        locationsOfNonInstructions[name].insert(index);
     }
 }
 
@@ -197,6 +240,9 @@ static void emitReturn() {
 }
 
 static uint8_t makeConstant(Value value) {
+    if (!emitting) {
+        return 0;
+    }
     int constant = addConstant(currentChunk(), value);
     if (constant > UINT8_MAX) {
         error("Too many constants in one chunk.");
@@ -212,6 +258,9 @@ static void emitConstant(Value value){
 }
 
 static void patchJump(int offset) {
+    if (!emitting) {
+        return;
+    }
     int jump = currentChunk()->count - offset - 2;
     
     if (jump > UINT16_MAX) {
@@ -222,21 +271,30 @@ static void patchJump(int offset) {
     currentChunk()->code[offset + 1] = jump & 0xff;
 }
 
-static void initCompiler(Compiler* compiler, FunctionType type) {
-    compiler->enclosing = current;
+// Starts a new function, or with lazy set, the skipped function it belongs to.
+static void initCompiler(Compiler* compiler, FunctionType type, LazyFunction* lazy, ObjFunction* function) {
+    compiler->enclosing = lazy == NULL ? current : NULL;
     compiler->function = NULL;
     compiler->type = type;
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
-    compiler->function = newFunction();
+    compiler->lazy = lazy;
+    initChunk(&compiler->chunk);
+    compiler->body = sourceStart;
+    compiler->assignedNames = NULL;
+    compiler->assignedCount = -1;
+    compiler->assignedCapacity = 0;
+    compiler->function = lazy == NULL ? newFunction() : function;
     current = compiler;
-    if (type != TYPE_SCRIPT) {
+    if (type != TYPE_SCRIPT && lazy == NULL && emitting) {
         current->function->name = copyString(parser.previous.start, parser.previous.length);
     }
 
     Local* local = &current->locals[current->localCount++];
     local->depth = 0;
     local->isCaptured = false;
+    local->isAssigned = -1;
+    local->isScoped = false;
     if (type != TYPE_FUNCTION) {
         local->name.start = "this";
         local->name.length = 4;
@@ -247,17 +305,37 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
     
 }
 
+// A skipped function gets no code yet. When its body is compiled later it is
+// already listed for the serializer and already has its upvalues. A function
+// inside a body being checked is only parsed, and is dropped.
 static ObjFunction* endCompiler() {
-    emitReturn();
     ObjFunction* function = current->function;
-    if (!parser.hadError) {
-        disassembleChunk(currentChunk(), function->name != NULL 
-            ? function->name->chars : "<script>");
+    if (!emitting) {
+        current = current->enclosing;
+        return function;
+    }
+    if (function->lazy == NULL) {
+        emitReturn();
+        freezeChunk(&function->chunk, currentChunk());
+        if (!parser.hadError) {
+            disassembleChunk(&function->chunk, function->name != NULL 
+                ? function->name->chars : "<script>");
+        }
+    }
+    if (current->lazy != NULL) {
+        current = current->enclosing;
+        return function;
     }
     locationOfFunctions.push_back(function);
     for (int i = 0; i < current->function->upvalueCount; i++){
         locationOfUpvalues[(uint64_t) function].push_back(current->upvalues[i]);
     }
+    // The function is still reachable through current if this collects.
+    if (function->upvalueCount > 0) {
+        Upvalue* upvalues = allocate<Upvalue>(function->upvalueCount);
+        memcpy(upvalues, current->upvalues, sizeof(Upvalue) * function->upvalueCount);
+        function->upvalues = upvalues;
+    }
     current = current->enclosing;
     return function;
 }
@@ -358,15 +436,24 @@ static void grouping(bool canAssign) {
 }
 
 static void number(bool canAssign) {
+    if (!emitting) {
+        return;
+    }
     double value = strtod(parser.previous.start, NULL);
     emitConstant(numberVal(value));
 }
 
 static void string(bool canAssign) {
+    if (!emitting) {
+        return;
+    }
     emitConstant(objVal((Obj*) copyString(parser.previous.start + 1, parser.previous.length - 2)));
 }
 
 static uint8_t identifierConstant(Token* name) {
+    if (!emitting) {
+        return 0;
+    }
     return makeConstant(objVal((Obj*) copyString(name->start, name->length)));
 }
 
@@ -390,7 +477,46 @@ static int resolveLocal(Compiler* compiler, Token* name) {
     return -1;
 }
 
-static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
+static bool nameBefore(const Token& a, const Token& b) {
+    if (a.length != b.length) {
+        return a.length < b.length;
+    }
+    return memcmp(a.start, b.start, a.length) < 0;
+}
+
+static void addAssignedName(Token* name, void* context) {
+    Compiler* compiler = (Compiler*) context;
+    if (compiler->assignedCount + 1 > compiler->assignedCapacity) {
+        int oldCapacity = compiler->assignedCapacity;
+        compiler->assignedCapacity = growCapacity(oldCapacity);
+        compiler->assignedNames = growScratchArray<Token>(compiler->assignedNames,
+            oldCapacity, compiler->assignedCapacity);
+    }
+    compiler->assignedNames[compiler->assignedCount++] = *name;
+}
+
+// Any assignment to a local is inside the body of the function that declares
+// it, so one scan of that body answers for all of its locals. Names of this
+// and super are not in the source and can't be assigned to.
+static bool isAssigned(Compiler* compiler, Local* local) {
+    if (local->isAssigned == -1) {
+        const char* start = local->name.start;
+        if (start < sourceStart || start >= sourceEnd) {
+            local->isAssigned = false;
+            return false;
+        }
+        if (compiler->assignedCount == -1) {
+            compiler->assignedCount = 0;
+            scanAssignments(compiler->body, addAssignedName, compiler);
+            std::sort(compiler->assignedNames, compiler->assignedNames + compiler->assignedCount, nameBefore);
+        }
+        local->isAssigned = std::binary_search(compiler->assignedNames,
+            compiler->assignedNames + compiler->assignedCount, local->name, nameBefore);
+    }
+    return local->isAssigned;
+}
+
+static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal, bool isCopy) {
     int upvalueCount = compiler->function->upvalueCount;
 
     for (int i = 0; i < upvalueCount; i++){
@@ -407,23 +533,43 @@ static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
 
     compiler->upvalues[upvalueCount].isLocal = isLocal;
     compiler->upvalues[upvalueCount].index = index;
+    compiler->upvalues[upvalueCount].isCopy = isCopy;
     return compiler->function->upvalueCount++;
 }
 
+static int resolveLazyUpvalue(Compiler* compiler, Token* name) {
+    for (int i = 0; i < compiler->function->upvalueCount; i++) {
+        if (identifiersEqual(name, &compiler->lazy->upvalueNames[i])) {
+            return i;
+        }
+    }
+    return -1;
+}
+
 static int resolveUpvalue(Compiler* compiler, Token* name) {
     if (compiler->enclosing == NULL){
-        return -1;
+        return compiler->lazy != NULL ? resolveLazyUpvalue(compiler, name) : -1;
     }
 
     int local = resolveLocal(compiler->enclosing, name);
     if (local != -1) {
-        compiler->enclosing->locals[local].isCaptured = true;
-        return addUpvalue(compiler, (uint8_t) local, true);
+        // A local that is never assigned again can't change after the closure
+        // is created, so the closure can hold a copy of its value.
+        bool isCopy = !isAssigned(compiler->enclosing, &compiler->enclosing->locals[local]);
+        if (!isCopy) {
+            compiler->enclosing->locals[local].isCaptured = true;
+        }
+        int index = addUpvalue(compiler, (uint8_t) local, true, isCopy);
+        compiler->upvalueNames[index] = *name;
+        return index;
     }
     
     int upvalue = resolveUpvalue(compiler->enclosing, name);
     if (upvalue != -1) {
-        return addUpvalue(compiler, (uint8_t) upvalue, false);
+        int index = addUpvalue(compiler, (uint8_t) upvalue, false,
+            compiler->enclosing->upvalues[upvalue].isCopy);
+        compiler->upvalueNames[index] = *name;
+        return index;
     }
 
     return -1;
@@ -437,7 +583,7 @@ static void namedVariable(Token name, bool canAssign){
         getOp = OP_GET_LOCAL;
         setOp = OP_SET_LOCAL;
     } else if ((arg = resolveUpvalue(current, &name)) != -1){
-        getOp = OP_GET_UPVALUE;
+        getOp = current->upvalues[arg].isCopy ? OP_GET_CAPTURED : OP_GET_UPVALUE;
         setOp = OP_SET_UPVALUE;
     }
     else{
@@ -570,6 +716,8 @@ static void addLocal(Token name) {
     local->name = name;
     local->depth = -1;
     local->isCaptured = false;
+    local->isAssigned = -1;
+    local->isScoped = false;
 }
 
 static void declareVariable() {
@@ -640,45 +788,46 @@ static void or_(bool canAssign) {
 }
 
 ParseRule rules[] = {
-    [TOKEN_LEFT_PAREN]      = {grouping, call,    PREC_CALL},
-    [TOKEN_RIGHT_PAREN]     = {NULL,     NULL,    PREC_NONE},
-    [TOKEN_LEFT_BRACE]      = {NULL,     NULL,    PREC_NONE},
-    [TOKEN_RIGHT_BRACE]     = {NULL,     NULL,    PREC_NONE},
-    [TOKEN_COMMA]           = {NULL,     NULL,    PREC_NONE},
-    [TOKEN_DOT]             = {NULL,     dot,     PREC_CALL},
-    [TOKEN_MINUS]           = {unary,    binary,  PREC_TERM},
-    [TOKEN_PLUS]            = {NULL,     binary,  PREC_TERM},
-    [TOKEN_SEMICOLON]       = {NULL,     NULL,    PREC_NONE},
-    [TOKEN_SLASH]           = {NULL,     binary,  PREC_FACTOR},
-    [TOKEN_STAR]            = {NULL,     binary,  PREC_FACTOR},
-    [TOKEN_BANG]            = {unary,    NULL,    PREC_NONE},
-    [TOKEN_BANG_EQUAL]      = {NULL,     binary,  PREC_EQUALITY},
-    [TOKEN_EQUAL]           = {NULL,     NULL,    PREC_NONE},
-    [TOKEN_EQUAL_EQUAL]     = {NULL,     binary,  PREC_EQUALITY},
-    [TOKEN_GREATER]         = {NULL,     binary,  PREC_COMPARISON},
-    [TOKEN_GREATER_EQUAL]   = {NULL,     binary,  PREC_COMPARISON},
-    [TOKEN_LESS]            = {NULL,     binary,  PREC_COMPARISON},
-    [TOKEN_LESS_EQUAL]      = {NULL,     binary,  PREC_COMPARISON},
-    [TOKEN_IDENTIFIER]      = {variable, NULL,    PREC_NONE},
-    [TOKEN_STRING]          = {string,   NULL,    PREC_NONE},
-    [TOKEN_NUMBER]          = {number,   NULL,    PREC_NONE},
-    [TOKEN_AND]             = {NULL,     and_,    PREC_AND},
-    [TOKEN_CLASS]           = {NULL,     NULL,    PREC_NONE},
-    [TOKEN_ELSE]            = {NULL,     NULL,    PREC_NONE},
-    [TOKEN_FALSE]           = {literal,  NULL,    PREC_NONE},
-    [TOKEN_FOR]             = {NULL,     NULL,    PREC_NONE},
-    [TOKEN_IF]              = {NULL,     NULL,    PREC_NONE},
-    [TOKEN_NIL]             = {literal,  NULL,    PREC_NONE},
-    [TOKEN_OR]              = {NULL,     or_,     PREC_OR},
-    [TOKEN_PRINT]           = {NULL,     NULL,    PREC_NONE},
-    [TOKEN_RETURN]          = {NULL,     NULL,    PREC_NONE},
-    [TOKEN_SUPER]           = {super_,   NULL,    PREC_NONE},
-    [TOKEN_THIS]            = {this_,    NULL,   PREC_NONE},
-    [TOKEN_TRUE]            = {literal,  NULL,    PREC_NONE},
-    [TOKEN_VAR]             = {NULL,     NULL,    PREC_NONE},
-    [TOKEN_WHILE]           = {NULL,     NULL,    PREC_NONE},
-    [TOKEN_ERROR]           = {NULL,     NULL,    PREC_NONE},
-    [TOKEN_EOF]             = {NULL,     NULL,    PREC_NONE},   
+    /* TOKEN_LEFT_PAREN    */ {grouping, call,    PREC_CALL},
+    /* TOKEN_RIGHT_PAREN   */ {NULL,     NULL,    PREC_NONE},
+    /* TOKEN_LEFT_BRACE    */ {NULL,     NULL,    PREC_NONE},
+    /* TOKEN_RIGHT_BRACE   */ {NULL,     NULL,    PREC_NONE},
+    /* TOKEN_COMMA         */ {NULL,     NULL,    PREC_NONE},
+    /* TOKEN_DOT           */ {NULL,     dot,     PREC_CALL},
+    /* TOKEN_MINUS         */ {unary,    binary,  PREC_TERM},
+    /* TOKEN_PLUS          */ {NULL,     binary,  PREC_TERM},
+    /* TOKEN_SEMICOLON     */ {NULL,     NULL,    PREC_NONE},
+    /* TOKEN_SLASH         */ {NULL,     binary,  PREC_FACTOR},
+    /* TOKEN_STAR          */ {NULL,     binary,  PREC_FACTOR},
+    /* TOKEN_BANG          */ {unary,    NULL,    PREC_NONE},
+    /* TOKEN_BANG_EQUAL    */ {NULL,     binary,  PREC_EQUALITY},
+    /* TOKEN_EQUAL         */ {NULL,     NULL,    PREC_NONE},
+    /* TOKEN_EQUAL_EQUAL   */ {NULL,     binary,  PREC_EQUALITY},
+    /* TOKEN_GREATER       */ {NULL,     binary,  PREC_COMPARISON},
+    /* TOKEN_GREATER_EQUAL */ {NULL,     binary,  PREC_COMPARISON},
+    /* TOKEN_LESS          */ {NULL,     binary,  PREC_COMPARISON},
+    /* TOKEN_LESS_EQUAL    */ {NULL,     binary,  PREC_COMPARISON},
+    /* TOKEN_IDENTIFIER    */ {variable, NULL,    PREC_NONE},
+    /* TOKEN_STRING        */ {string,   NULL,    PREC_NONE},
+    /* TOKEN_NUMBER        */ {number,   NULL,    PREC_NONE},
+    /* TOKEN_AND           */ {NULL,     and_,    PREC_AND},
+    /* TOKEN_CLASS         */ {NULL,     NULL,    PREC_NONE},
+    /* TOKEN_ELSE          */ {NULL,     NULL,    PREC_NONE},
+    /* TOKEN_FALSE         */ {literal,  NULL,    PREC_NONE},
+    /* TOKEN_FOR           */ {NULL,     NULL,    PREC_NONE},
+    /* TOKEN_FUN           */ {NULL,     NULL,    PREC_NONE},
+    /* TOKEN_IF            */ {NULL,     NULL,    PREC_NONE},
+    /* TOKEN_NIL           */ {literal,  NULL,    PREC_NONE},
+    /* TOKEN_OR            */ {NULL,     or_,     PREC_OR},
+    /* TOKEN_PRINT         */ {NULL,     NULL,    PREC_NONE},
+    /* TOKEN_RETURN        */ {NULL,     NULL,    PREC_NONE},
+    /* TOKEN_SUPER         */ {super_,   NULL,    PREC_NONE},
+    /* TOKEN_THIS          */ {this_,    NULL,   PREC_NONE},
+    /* TOKEN_TRUE          */ {literal,  NULL,    PREC_NONE},
+    /* TOKEN_VAR           */ {NULL,     NULL,    PREC_NONE},
+    /* TOKEN_WHILE         */ {NULL,     NULL,    PREC_NONE},
+    /* TOKEN_ERROR         */ {NULL,     NULL,    PREC_NONE},
+    /* TOKEN_EOF           */ {NULL,     NULL,    PREC_NONE},
 };
 
 static ParseRule* getRule(TokenType type) {
@@ -693,7 +842,19 @@ static void varDeclaration() {
     uint8_t global = parseVariable("Expect variable name.");
 
     if (match(TOKEN_EQUAL)) {
+        // var p = Point(x, y); where p is only ever used to get at fields can
+        // have its instance freed when p goes out of scope.
+        bool scoped = false;
+        if (current->scopeDepth > 0 && emitting) {
+            Token* name = &current->locals[current->localCount - 1].name;
+            const char* end = scanCallStatement(parser.current.start);
+            scoped = end != NULL && !scanForEscape(end, TOKEN_IDENTIFIER, name->start, name->length);
+        }
         expression();
+        if (scoped && currentChunk()->code[currentChunk()->count - 2] == OP_CALL) {
+            currentChunk()->code[currentChunk()->count - 2] = OP_CALL_SCOPED;
+            current->locals[current->localCount - 1].isScoped = true;
+        }
     } else{
         emitByte(OP_NIL);
     }
@@ -804,11 +965,33 @@ static void beginScope() {
     current->scopeDepth++;
 }
 
-static void function(FunctionType type) {
-    Compiler compiler;
-    initCompiler(&compiler, type);
-    beginScope();
+// Parses a function body with emitting off, so its syntax errors are reported
+// now and its upvalues are resolved just as compiling it on the first call
+// will resolve them. Functions declared inside it are checked in the same pass.
+static void checkBody() {
+    emitting = false;
+    block();
+    emitting = true;
+}
+
+static void deferBody(const char* parameters, int line, FunctionType type) {
+    // The function is still reachable through current if these collect.
+    LazyFunction* lazy = allocate<LazyFunction>(1);
+    lazy->parameters = parameters;
+    lazy->line = line;
+    lazy->type = type;
+    lazy->inClass = currentClass != NULL;
+    lazy->hasSuperclass = currentClass != NULL && currentClass->hasSuperclass;
+    lazy->upvalueNames = NULL;
+    current->function->lazy = lazy;
+    int upvalueCount = current->function->upvalueCount;
+    if (upvalueCount > 0) {
+        lazy->upvalueNames = allocate<Token>(upvalueCount);
+        memcpy(lazy->upvalueNames, current->upvalueNames, sizeof(Token) * upvalueCount);
+    }
+}
 
+static void parameterList(FunctionType type) {
     consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
     if (!check(TOKEN_RIGHT_PAREN)){
         while (true){
@@ -825,14 +1008,34 @@ static void function(FunctionType type) {
     }
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
     consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
-    block();
+    current->body = parser.current.start;
+    if (type == TYPE_INITIALIZER && emitting) {
+        current->function->thisEscapes = scanForEscape(parser.current.start, TOKEN_THIS, NULL, 0);
+    }
+}
+
+static void function(FunctionType type) {
+    Compiler compiler;
+    initCompiler(&compiler, type, NULL, NULL);
+    beginScope();
+
+    const char* parameters = parser.current.start;
+    int line = parser.current.line;
+    parameterList(type);
+    if (lazyCompile && emitting) {
+        checkBody();
+        deferBody(parameters, line, type);
+    } else {
+        block();
+    }
 
     ObjFunction* function = endCompiler();
     emitBytes(OP_CLOSURE, makeConstant(objVal((Obj*) function)));
     insertInstructionsIntoMapSet(1);
 
     for (int i = 0; i < function->upvalueCount; i++) {
-        emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
+        // 1 captures a local by reference, 2 copies it.
+        emitByte(compiler.upvalues[i].isLocal ? (compiler.upvalues[i].isCopy ? 2 : 1) : 0);
         emitByte(compiler.upvalues[i].index);
         insertInstructionsIntoMapSet(2);
     }
@@ -857,6 +1060,8 @@ static void endScope() {
     while (current->localCount > 0 && current->locals[current->localCount - 1].depth > current->scopeDepth) {
         if (current->locals[current->localCount - 1].isCaptured){
             emitByte(OP_CLOSE_UPVALUE);
+        } else if (current->locals[current->localCount - 1].isScoped) {
+            emitByte(OP_POP_SCOPED);
         } else{
             emitByte(OP_POP);
         }
@@ -999,9 +1204,11 @@ static void declaration() {
 }
 
 ObjFunction* compile(const char* source) {
+    sourceStart = source;
+    sourceEnd = source + strlen(source);
     initScanner(source);
     Compiler compiler;
-    initCompiler(&compiler, TYPE_SCRIPT);
+    initCompiler(&compiler, TYPE_SCRIPT, NULL, NULL);
 
     parser.hadError = false;
     parser.panicMode = false;
@@ -1013,13 +1220,55 @@ ObjFunction* compile(const char* source) {
     }
     
     ObjFunction* function = endCompiler();
+    releaseScratch();
     return parser.hadError ? NULL : function;
 }
 
+// Compiles the body of a function skipped under lazyCompile, from the source
+// it was skipped in.
+bool compileLazyFunction(ObjFunction* function) {
+    LazyFunction* lazy = function->lazy;
+    resumeScanner(lazy->parameters, lazy->line);
+    parser.hadError = false;
+    parser.panicMode = false;
+
+    ClassCompiler classCompiler;
+    classCompiler.enclosing = NULL;
+    classCompiler.hasSuperclass = lazy->hasSuperclass;
+    currentClass = lazy->inClass ? &classCompiler : NULL;
+
+    Compiler compiler;
+    initCompiler(&compiler, lazy->type, lazy, function);
+    if (function->upvalueCount > 0) {
+        memcpy(compiler.upvalues, function->upvalues, sizeof(Upvalue) * function->upvalueCount);
+    }
+    function->lazy = NULL;
+    function->arity = 0;
+    beginScope();
+
+    advance();
+    parameterList(lazy->type);
+    block();
+    endCompiler();
+    releaseScratch();
+
+    currentClass = NULL;
+    freeLazyFunction(lazy, function->upvalueCount);
+    return !parser.hadError;
+}
+
+void freeLazyFunction(LazyFunction* lazy, int upvalueCount) {
+    freeArray<Token>(lazy->upvalueNames, upvalueCount);
+    freeArray<LazyFunction>(lazy, 1);
+}
+
 void markCompilerRoots() {
     Compiler* compiler = current;
     while (compiler != NULL) {
         markObject((Obj*) compiler->function);
+        for (int i = 0; i < compiler->chunk.constants.count; i++) {
+            markValue(compiler->chunk.constants.values[i]);
+        }
         compiler = compiler->enclosing;
     }
 }
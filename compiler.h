@@ -4,13 +4,17 @@
 #include "object.h"
 #include <unordered_map>
 #include <set>
+#include <vector>
+#include <string>
 
-typedef struct {
-    uint8_t index;
-    bool isLocal;
-} Upvalue;
+// With lazyCompile set, function bodies are only parsed when the script is
+// compiled and are compiled on their first call.
+// The source has to outlive the run.
+extern bool lazyCompile;
 
 ObjFunction* compile(const char* source);
+bool compileLazyFunction(ObjFunction* function);
+void freeLazyFunction(struct LazyFunction* lazy, int upvalueCount);
 extern std::vector<ObjFunction*> locationOfFunctions;
 extern std::unordered_map<std::string, std::set<uint64_t>> locationsOfNonInstructions;
 extern std::unordered_map<uint64_t, std::vector<Upvalue>> locationOfUpvalues;
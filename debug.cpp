@@ -53,13 +53,14 @@ static int invokeInstruction(const char* name, Chunk* chunk, int offset) {
 int disassembleInstruction(Chunk *chunk, int offset)
 {
     printf("%04d ", offset);
-    if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1])
+    int line = getLine(chunk, offset);
+    if (offset > 0 && line == getLine(chunk, offset - 1))
     {
         printf("   | ");
     }
     else
     {
-        printf("%4d ", chunk->lines[offset]);
+        printf("%4d ", line);
     }
     uint8_t instruction = chunk->code[offset];
     printf(" %4d ", instruction);
@@ -87,6 +88,12 @@ int disassembleInstruction(Chunk *chunk, int offset)
             return constantInstruction("OP_SET_GLOBAL", chunk, offset);
         case OP_GET_UPVALUE:
             return byteInstruction("OP_GET_UPVALUE", chunk, offset);
+        case OP_GET_CAPTURED:
+            return byteInstruction("OP_GET_CAPTURED", chunk, offset);
+        case OP_CALL_SCOPED:
+            return byteInstruction("OP_CALL_SCOPED", chunk, offset);
+        case OP_POP_SCOPED:
+            return simpleInstruction("OP_POP_SCOPED", offset);
         case OP_SET_UPVALUE:
             return byteInstruction("OP_SET_UPVALUE", chunk, offset);
         case OP_EQUAL:
@@ -117,7 +124,7 @@ int disassembleInstruction(Chunk *chunk, int offset)
                 int isLocal = chunk->code[offset++];
                 int index = chunk->code[offset++];
                 printf("%04d   |                %s %d\n", offset - 2,
-                    isLocal ? "local" : "upvalue", index);
+                    isLocal == 2 ? "copy" : isLocal ? "local" : "upvalue", index);
             }
 
             return offset;
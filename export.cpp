@@ -0,0 +1,60 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fstream>
+#include <thread>
+#include "compiler.h"
+#include "export.h"
+#include "serialize.h"
+#include "vm.h"
+
+const char* vmdataPath = NULL;
+
+static std::thread writer;
+static bool exportFailed = false;
+
+static void writeVMData(ObjFunction* script, std::vector<ObjString*> strings) {
+    std::fstream output(vmdataPath, std::ios::out | std::ios::trunc | std::ios::binary);
+    bool written;
+    if (vmdataVersion == 1) {
+        written = serializeVMData(strings, locationOfFunctions, locationsOfNonInstructions, locationOfUpvalues)
+            .SerializeToOstream(&output);
+    } else {
+        written = serializeVMDataV2(locationOfFunctions, script).SerializeToOstream(&output);
+    }
+    output.close();
+    if (!written || output.fail()) {
+        fprintf(stderr, "Failed to write VMData to %s.\n", vmdataPath);
+        exportFailed = true;
+    }
+}
+
+static void waitAtExit() {
+    finishVMDataExport();
+}
+
+void startVMDataExport(ObjFunction* script) {
+    // Version 1 lists every interned string. The table changes as the script
+    // runs, so its entries are copied here.
+    std::vector<ObjString*> strings;
+    if (vmdataVersion == 1) {
+        Ref<ObjString>* keys = tableKeys(&vm.strings);
+        for (int i = 0; i < tableSlots(&vm.strings); i++) {
+            if (tableSlotInUse(&vm.strings, i)) {
+                strings.push_back(keys[i]);
+            }
+        }
+    }
+    static bool registered = false;
+    if (!registered) {
+        atexit(waitAtExit);
+        registered = true;
+    }
+    writer = std::thread(writeVMData, script, std::move(strings));
+}
+
+bool finishVMDataExport() {
+    if (writer.joinable()) {
+        writer.join();
+    }
+    return !exportFailed;
+}
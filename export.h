@@ -0,0 +1,15 @@
+#pragma once
+
+#include "common.h"
+#include "object.h"
+
+// Where --export-vmdata writes VMData, NULL when export is off.
+extern const char* vmdataPath;
+
+// Builds and writes the VMData for script on a background thread while the
+// script runs. The writer reads compiled code, constants and names, which
+// nothing changes once compilation is over, and object headers, which the
+// collector does. collectGarbage() and freeVM() therefore wait for it first.
+void startVMDataExport(ObjFunction* script);
+// Waits for the writer, if one was started. Returns false if it failed.
+bool finishVMDataExport();
@@ -0,0 +1,62 @@
+#include "cache.h"
+#include "compiler.h"
+#include "export.h"
+#include "interpret.h"
+
+
+static void waitForExport() {
+    finishVMDataExport();
+}
+
+static void freeLazy(ObjFunction* function) {
+    freeLazyFunction(function->lazy, function->upvalueCount);
+}
+
+static void installHooks() {
+    vmHooks.markRoots = markCompilerRoots;
+    vmHooks.beforeFree = waitForExport;
+    vmHooks.compileFunction = compileLazyFunction;
+    vmHooks.freeLazyFunction = freeLazy;
+}
+
+// Skipped functions have no code to export yet, so lazy scripts write no
+// VMData.
+static InterpretResult start(ObjFunction* function, bool exportVMData) {
+    if (exportVMData && !lazyCompile && vmdataPath != NULL) {
+        startVMDataExport(function);
+    }
+    return runScript(function);
+}
+
+InterpretResult interpret(const char* source) {
+    installHooks();
+    ObjFunction* function = compile(source);
+    if (function == NULL) return INTERPRET_COMPILE_ERROR;
+    return start(function, true);
+}
+
+// Compiled code keeps copies of every name and literal it needs, so the text
+// is released before the script starts running, unless function bodies are
+// still to be compiled from it. With a cachePath the script is loaded from or
+// saved to its bytecode cache. The export needs what the compiler records
+// about each function, so it skips loading from the cache.
+InterpretResult interpretSource(Source* source, const char* cachePath) {
+    installHooks();
+    bool useCache = cachePath != NULL && vmdataPath == NULL;
+    ObjFunction* function = useCache ? loadBytecodeCache(cachePath, source) : NULL;
+    bool cached = function != NULL;
+    if (!cached) {
+        function = compile(source->chars);
+        if (function != NULL && cachePath != NULL) {
+            writeBytecodeCache(cachePath, source, function);
+        }
+    }
+    if (!lazyCompile || function == NULL) {
+        freeSource(source);
+    }
+    if (function == NULL) return INTERPRET_COMPILE_ERROR;
+    InterpretResult result = start(function, !cached);
+    freeSource(source);
+    closeBytecodeCache();
+    return result;
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include "source.h"
+#include "vm.h"
+
+// Compile and run a script. These link the compiler and everything around
+// it into the VM; a VM that only runs VMData artifacts uses runScript().
+InterpretResult interpret(const char* source);
+InterpretResult interpretSource(Source* source, const char* cachePath);
@@ -0,0 +1,62 @@
+#include <string.h>
+
+#include "loaded.h"
+#include "memory.h"
+#include "vm.h"
+
+ValueArray loaded;
+
+void keepLoaded(Value value) {
+    push(value);
+    writeValueArray(&loaded, value);
+    pop();
+}
+
+void markLoadedRoots() {
+    for (int i = 0; i < loaded.count; i++) {
+        markValue(loaded.values[i]);
+    }
+}
+
+void allocateUpvalues(ObjFunction* function, int count) {
+    if (count > 0) {
+        function->upvalues = allocate<Upvalue>(count);
+        memset(function->upvalues, 0, sizeof(Upvalue) * count);
+    }
+    function->upvalueCount = count;
+}
+
+// Saved functions don't store upvalue descriptors on their own. They are read
+// back from the operands of the OP_CLOSURE that creates each function, which
+// also checks that every instruction fits in its chunk.
+bool describeUpvalues(ObjFunction* function) {
+    Chunk* chunk = &function->chunk;
+    for (int offset = 0; offset < chunk->count;) {
+        uint8_t instruction = chunk->code[offset];
+        int length = 1 + operandBytes(instruction);
+        if (offset + length > chunk->count) {
+            return false;
+        }
+        if (instruction == OP_CLOSURE) {
+            uint8_t constant = chunk->code[offset + 1];
+            if (constant >= chunk->constants.count || !isObj(chunk->constants.values[constant])
+                    || !isFunction(chunk->constants.values[constant])) {
+                return false;
+            }
+            ObjFunction* closed = asFunction(chunk->constants.values[constant]);
+            length += 2 * closed->upvalueCount;
+            if (offset + length > chunk->count) {
+                return false;
+            }
+            for (int i = 0; i < closed->upvalueCount; i++) {
+                // 1 captures a local by reference, 2 copies it.
+                uint8_t kind = chunk->code[offset + 2 + 2 * i];
+                closed->upvalues[i].isLocal = kind != 0;
+                closed->upvalues[i].isCopy = kind == 2;
+                closed->upvalues[i].index = chunk->code[offset + 3 + 2 * i];
+            }
+        }
+        offset += length;
+    }
+    return true;
+}
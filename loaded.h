@@ -0,0 +1,15 @@
+#pragma once
+
+#include "common.h"
+#include "object.h"
+
+// What the bytecode cache and the VMData loader share to turn saved functions
+// back into objects. loaded holds the strings and functions made so far by a
+// load, which the collector marks until the load frees the array.
+extern ValueArray loaded;
+
+void keepLoaded(Value value);
+void markLoadedRoots();
+// The descriptors are filled in by describeUpvalues().
+void allocateUpvalues(ObjFunction* function, int count);
+bool describeUpvalues(ObjFunction* function);
@@ -0,0 +1,239 @@
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "loaded.h"
+#include "loader.h"
+#include "memory.h"
+#include "vm.h"
+#include "vmdata.pb.h"
+
+// A version 2 file starts with its version field (field 1, varint) and a
+// version 1 file with its first context (field 1, length delimited).
+const uint8_t VMDATA_V2_FIRST_BYTE = 0x08;
+const uint32_t VMDATA_VERSION = 2;
+
+static const char* loadPath = NULL;
+
+static ObjFunction* loadError(const char* message) {
+    fprintf(stderr, "Could not load %s: %s.\n", loadPath, message);
+    return NULL;
+}
+
+static void setCode(ObjFunction* function, const uint8_t* code, int length) {
+    uint8_t* copy = allocate<uint8_t>(length);
+    memcpy(copy, code, length);
+    function->chunk.code = copy;
+    function->chunk.count = length;
+    function->chunk.capacity = length;
+}
+
+static bool describeAllUpvalues(int first, int count) {
+    for (int i = first; i < first + count; i++) {
+        if (!describeUpvalues(asFunction(loaded.values[i]))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static ObjFunction* loadV2(const serializationPackage::VMDataV2& data) {
+    if (data.version() != VMDATA_VERSION) {
+        return loadError("unsupported VMData version");
+    }
+    // The operand widths stand in for the opcode set the file was made for.
+    if (data.operandbytes_size() != OP_POP_SCOPED + 1) {
+        return loadError("compiled for different opcodes");
+    }
+    for (int i = 0; i <= OP_POP_SCOPED; i++) {
+        if (data.operandbytes(i) != (uint32_t) operandBytes(i)) {
+            return loadError("compiled for different opcodes");
+        }
+    }
+    int stringCount = data.strings_size();
+    int functionCount = data.functions_size();
+    if (data.script() >= (uint32_t) functionCount) {
+        return loadError("no script");
+    }
+
+    for (const std::string& string : data.strings()) {
+        keepLoaded(objVal((Obj*) copyString(string.data(), (int) string.size())));
+    }
+    for (int i = 0; i < functionCount; i++) {
+        keepLoaded(objVal((Obj*) newFunction()));
+    }
+
+    for (int i = 0; i < functionCount; i++) {
+        const serializationPackage::FunctionV2& saved = data.functions(i);
+        ObjFunction* function = asFunction(loaded.values[stringCount + i]);
+        if (saved.name() < -1 || saved.name() >= stringCount
+                || saved.upvaluecount() > UINT8_COUNT || saved.code().empty()) {
+            return loadError("malformed function");
+        }
+        function->name = saved.name() >= 0 ? asString(loaded.values[saved.name()]) : NULL;
+        function->arity = (int) saved.arity();
+        function->thisEscapes = !saved.thisdoesnotescape();
+        allocateUpvalues(function, (int) saved.upvaluecount());
+        setCode(function, (const uint8_t*) saved.code().data(), (int) saved.code().size());
+
+        Chunk* chunk = &function->chunk;
+        int runs = saved.lines_size() / 2;
+        if (runs > 0) {
+            chunk->lines = allocate<LineStart>(runs);
+            chunk->lineCapacity = runs;
+        }
+        int offset = 0;
+        for (int j = 0; j < runs; j++) {
+            uint32_t count = saved.lines(2 * j + 1);
+            if (count > (uint32_t) (chunk->count - offset)) {
+                return loadError("line table longer than the code");
+            }
+            chunk->lines[chunk->lineCount].offset = offset;
+            chunk->lines[chunk->lineCount].line = (int) saved.lines(2 * j);
+            chunk->lineCount++;
+            offset += (int) count;
+        }
+
+        for (const serializationPackage::ConstantV2& constant : saved.constants()) {
+            Value value = nilVal();
+            switch (constant.value_case()) {
+                case serializationPackage::ConstantV2::kNumber:
+                    value = numberVal(constant.number());
+                    break;
+                case serializationPackage::ConstantV2::kBoolean:
+                    value = boolVal(constant.boolean());
+                    break;
+                case serializationPackage::ConstantV2::kStringIndex:
+                    if (constant.stringindex() >= (uint32_t) stringCount) {
+                        return loadError("constant names a missing string");
+                    }
+                    value = loaded.values[constant.stringindex()];
+                    break;
+                case serializationPackage::ConstantV2::kFunctionIndex:
+                    if (constant.functionindex() >= (uint32_t) functionCount) {
+                        return loadError("constant names a missing function");
+                    }
+                    value = loaded.values[stringCount + constant.functionindex()];
+                    break;
+                default:
+                    break;
+            }
+            writeValueArray(&function->chunk.constants, value);
+        }
+    }
+
+    if (!describeAllUpvalues(stringCount, functionCount)) {
+        return loadError("malformed code");
+    }
+    return asFunction(loaded.values[stringCount + data.script()]);
+}
+
+// Version 1 refers to strings and functions by their addresses in the process
+// that wrote it, and stores each byte of code under its own address.
+static ObjFunction* loadV1(const serializationPackage::VMData& data) {
+    std::unordered_map<int64_t, Value> objects;
+    for (const auto& entry : data.stringsataddresses()) {
+        Value string = objVal((Obj*) copyString(entry.first.data(), (int) entry.first.size()));
+        keepLoaded(string);
+        objects[entry.second.address()] = string;
+    }
+    int first = loaded.count;
+    for (const serializationPackage::Context& context : data.contexts()) {
+        Value function = objVal((Obj*) newFunction());
+        keepLoaded(function);
+        objects[context.functionaddress()] = function;
+    }
+
+    ObjFunction* script = NULL;
+    for (int i = 0; i < data.contexts_size(); i++) {
+        const serializationPackage::Context& context = data.contexts(i);
+        ObjFunction* function = asFunction(loaded.values[first + i]);
+        if (context.contextname().empty()) {
+            script = function;
+        } else {
+            function->name = copyString(context.contextname().data(), (int) context.contextname().size());
+        }
+        if (context.upvaluecount() < 0 || context.upvaluecount() > UINT8_COUNT
+                || context.instructionvals().empty()) {
+            return loadError("malformed function");
+        }
+        function->arity = context.arity();
+        allocateUpvalues(function, context.upvaluecount());
+
+        std::vector<std::pair<int64_t, const serializationPackage::InstructionType*>> bytes;
+        for (const auto& entry : context.instructionvals()) {
+            bytes.emplace_back(entry.first, &entry.second);
+        }
+        std::sort(bytes.begin(), bytes.end(),
+            [](const auto& a, const auto& b) { return a.first < b.first; });
+        std::vector<uint8_t> code;
+        for (const auto& byte : bytes) {
+            if (byte.first != context.firstinstructionaddress() + (int64_t) code.size()) {
+                return loadError("gap in code");
+            }
+            code.push_back(byte.second->has_opcode()
+                ? (uint8_t) byte.second->opcode() : (uint8_t) byte.second->addressorconstant());
+        }
+        setCode(function, code.data(), (int) code.size());
+
+        for (int j = 0; j < (int) context.constantvals().size(); j++) {
+            auto saved = context.constantvals().find(j);
+            if (saved == context.constantvals().end()) {
+                return loadError("gap in constants");
+            }
+            const serializationPackage::ValueType& constant = saved->second;
+            Value value = nilVal();
+            if (constant.has_numval()) {
+                value = numberVal(constant.numval());
+            } else if (constant.has_boolval()) {
+                value = boolVal(constant.boolval());
+            } else if (constant.has_stringaddress() || constant.has_functionaddress()) {
+                auto found = objects.find(constant.has_stringaddress()
+                    ? constant.stringaddress() : constant.functionaddress());
+                if (found == objects.end()
+                        || (constant.has_stringaddress() ? !isString(found->second) : !isFunction(found->second))) {
+                    return loadError("constant names a missing object");
+                }
+                value = found->second;
+            }
+            writeValueArray(&function->chunk.constants, value);
+        }
+    }
+
+    if (script == NULL) {
+        return loadError("no script");
+    }
+    if (!describeAllUpvalues(first, data.contexts_size())) {
+        return loadError("malformed code");
+    }
+    return script;
+}
+
+// Loaded files are trusted: the checks catch files that are cut short or were
+// written for another VM, not bytecode crafted to misbehave.
+ObjFunction* loadVMData(const char* path) {
+    loadPath = path;
+    std::ifstream input(path, std::ios::binary);
+    if (!input) {
+        return loadError("can't open the file");
+    }
+    std::string bytes((std::istreambuf_iterator<char>(input)), std::istreambuf_iterator<char>());
+
+    initValueArray(&loaded);
+    ObjFunction* script;
+    if (!bytes.empty() && (uint8_t) bytes[0] == VMDATA_V2_FIRST_BYTE) {
+        serializationPackage::VMDataV2 data;
+        script = data.ParseFromString(bytes) ? loadV2(data) : loadError("not VMData");
+    } else {
+        serializationPackage::VMData data;
+        script = data.ParseFromString(bytes) ? loadV1(data) : loadError("not VMData");
+    }
+    freeValueArray(&loaded);
+    return script;
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include "common.h"
+#include "object.h"
+
+// Rebuilds the functions, constants and strings of a VMData file of either
+// version and returns the script, or reports why it can't and returns NULL.
+// Version 2 files must come from a VM with the same opcodes; version 1 files
+// carry no line numbers, so runtime errors from them report line 0.
+ObjFunction* loadVMData(const char* path);
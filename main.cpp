@@ -1,8 +1,15 @@
 // Your First C++ Program
 #include "common.h"
 #include <iostream>
+#include <string.h>
+#include <time.h>
 #include "chunk.h"
+#include "compiler.h"
 #include "debug.h"
+#include "export.h"
+#include "interpret.h"
+#include "scanner.h"
+#include "serialize.h"
 #include "vm.h"
 
 static void repl(){
@@ -17,62 +24,126 @@ static void repl(){
     }
 }
 
-static char* readFile(const char* path){
-    FILE* file = fopen(path, "rb");
-    if (file == NULL) {
-        fprintf(stderr, "Could not open file \"%s\".\n", path);
+static void runFile(const char* path, bool cache){
+    Source source;
+    loadSource(path, &source);
+    InterpretResult result = interpretSource(&source, cache && strcmp(path, "-") != 0 ? path : NULL);
+    if (!finishVMDataExport()) {
         exit(74);
     }
 
-    fseek(file, 0L, SEEK_END);
-    size_t fileSize = ftell(file);
-    rewind(file);
-
-    char* buffer = (char*) malloc(fileSize + 1);
-
-    if (buffer == NULL) {
-        fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
-        exit(74);
+    if (result == INTERPRET_COMPILE_ERROR){
+        exit(65);
+    }
+    if (result == INTERPRET_RUNTIME_ERROR){
+        exit(70);
     }
+}
 
-    size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
-    if (bytesRead < fileSize) {
-        fprintf(stderr, "Could not read file \"%s\".\n", path);
+// Scans a generated source of roughly the given size and reports throughput.
+static void scanBenchmark(size_t megabytes) {
+    const char* sample =
+        "// Sums the points of a grid.\n"
+        "class Point {\n"
+        "    init(x, y) {\n"
+        "        this.x = x;\n"
+        "        this.y = y;\n"
+        "    }\n"
+        "}\n"
+        "\n"
+        "fun gridTotal(width, height) {\n"
+        "    var total = 0;\n"
+        "    for (var i = 0; i < width; i = i + 1) {\n"
+        "        var point = Point(i, height * 2.5);\n"
+        "        if (point.x >= 10 and !(point.y == nil)) total = total + point.x;\n"
+        "    }\n"
+        "    print \"total for the grid:\";\n"
+        "    return total;\n"
+        "}\n\n";
+    size_t sampleLength = strlen(sample);
+    size_t copies = megabytes * 1024 * 1024 / sampleLength + 1;
+    size_t size = copies * sampleLength;
+    char* source = (char*) malloc(size + 1);
+    if (source == NULL) {
+        fprintf(stderr, "Not enough memory for the scan benchmark.\n");
         exit(74);
     }
+    for (size_t i = 0; i < copies; i++) {
+        memcpy(source + i * sampleLength, sample, sampleLength);
+    }
+    source[size] = '\0';
 
-    buffer[bytesRead] = '\0';
-
-    fclose(file);
-    return buffer;
-}
+    clock_t start = clock();
+    initScanner(source);
+    size_t tokens = 0;
+    Token token;
+    do {
+        token = scanToken();
+        tokens++;
+    } while (token.type != TOKEN_EOF && token.type != TOKEN_ERROR);
+    double seconds = (double) (clock() - start) / CLOCKS_PER_SEC;
 
-static void runFile(const char* path){
-    char* source = readFile(path);
-    InterpretResult result = interpret(source);
+    double scanned = (double) size / (1024 * 1024);
+    printf("scanned %.1f MB, %zu tokens, %d lines in %.3f s (%.1f MB/s)\n",
+        scanned, tokens, token.line, seconds, seconds > 0 ? scanned / seconds : 0.0);
     free(source);
+}
 
-    if (result == INTERPRET_COMPILE_ERROR){
-        exit(65);
-    }
-    if (result == INTERPRET_RUNTIME_ERROR){
-        exit(70);
-    }
+static void usage() {
+    std::cerr << "Usage: clox [--arena] [--arena-limit=<MB>] [--arena-fallback=gc|fail] [--lazy] [--cache] [--export-vmdata=<path>] [--vmdata=1|2] [--scan-benchmark[=<MB>]] [path | -]" << std::endl;
+    exit(64);
 }
 
 int main(int argc, const char *argv[])
 {
-    initVM();
-    if (argc == 1) {
-        runFile("../test_scripts/superclasses_1.lox");
+    const char* path = NULL;
+    bool arena = false;
+    size_t arenaLimit = 256 * 1024 * 1024;
+    ArenaFallback arenaFallback = ARENA_FALLBACK_GC;
+    bool cache = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--arena") == 0) {
+            arena = true;
+        } else if (strncmp(argv[i], "--arena-limit=", 14) == 0) {
+            arena = true;
+            arenaLimit = (size_t) strtoull(argv[i] + 14, NULL, 10) * 1024 * 1024;
+        } else if (strcmp(argv[i], "--arena-fallback=gc") == 0) {
+            arenaFallback = ARENA_FALLBACK_GC;
+        } else if (strcmp(argv[i], "--arena-fallback=fail") == 0) {
+            arenaFallback = ARENA_FALLBACK_FAIL;
+        } else if (strcmp(argv[i], "--cache") == 0) {
+            cache = true;
+        } else if (strcmp(argv[i], "--lazy") == 0) {
+            lazyCompile = true;
+        } else if (strncmp(argv[i], "--export-vmdata=", 16) == 0 && argv[i][16] != '\0') {
+            vmdataPath = argv[i] + 16;
+        } else if (strcmp(argv[i], "--vmdata=1") == 0) {
+            vmdataVersion = 1;
+        } else if (strcmp(argv[i], "--vmdata=2") == 0) {
+            vmdataVersion = 2;
+        } else if (strcmp(argv[i], "--scan-benchmark") == 0) {
+            scanBenchmark(64);
+            return 0;
+        } else if (strncmp(argv[i], "--scan-benchmark=", 17) == 0) {
+            scanBenchmark((size_t) strtoull(argv[i] + 17, NULL, 10));
+            return 0;
+        } else if ((argv[i][0] == '-' && argv[i][1] != '\0') || path != NULL) {
+            usage();
+        } else {
+            path = argv[i];
+        }
     }
-    else if (argc == 2){
-        runFile(argv[1]);
+
+    // Every function has to be compiled to be cached or exported.
+    if (cache || vmdataPath != NULL) {
+        lazyCompile = false;
     }
-    else{
-        std::cerr << "Usage: clox [path]" << std::endl;
-        exit(64);
+    if (arena) {
+        enableArenaMode(arenaLimit, arenaFallback);
     }
+    initVM();
+    runFile(path != NULL ? path : "../test_scripts/superclasses_1.lox", cache);
 
     freeVM();
     return 0;
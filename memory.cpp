@@ -1,8 +1,13 @@
 #include "memory.h"
 #include "vm.h"
-#include "compiler.h"
+#include "arena.h"
+#include "cage.h"
+#include "loaded.h"
 
 const int GC_HEAP_GROW_FACTOR = 2;
+// Sweeping walks every page of the cage, so don't collect a tiny heap over
+// and over once it has grown.
+const size_t GC_MIN_HEAP = 1024 * 1024;
 
 int growCapacity(int capacity)
 {
@@ -18,13 +23,15 @@ static void markRoots() {
         markObject((Obj*) vm.frames[i].closure);
     }
     
-    for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL;
-        upvalue = upvalue->next){
-        markObject((Obj*) upvalue);
+    for (int i = 0; i < vm.stackTop - vm.stack; i++) {
+        markObject((Obj*) vm.openUpvalues[i]);
     }
 
     markTable(&vm.globals);
-    markCompilerRoots();
+    markLoadedRoots();
+    if (vmHooks.markRoots != NULL) {
+        vmHooks.markRoots();
+    }
     markObject((Obj*) vm.initString);
 }
 
@@ -57,14 +64,17 @@ static void blackenObject(Obj* object) {
         case OBJ_CLASS: {
             ObjClass* klass = (ObjClass*) object;
             markObject((Obj*) klass->name);
+            markObject((Obj*) klass->superclass);
+            markObject((Obj*) klass->initializer);
             markTable(&klass->methods);
+            markTable(&klass->methodCache);
             break;
         }
         case OBJ_CLOSURE: {
             ObjClosure* closure = (ObjClosure*) object;
             markObject((Obj*) closure->function);
             for (int i = 0; i < closure->upvalueCount; i++) {
-                markObject((Obj*) closure->upvalues[i]);
+                markValue(closure->upvalues[i]);
             }
             break;
         }
@@ -84,6 +94,13 @@ static void blackenObject(Obj* object) {
             markValue(((ObjUpvalue*) object)->closed);
             break;
         }
+        case OBJ_ROPE: {
+            ObjRope* rope = (ObjRope*) object;
+            markObject(rope->left);
+            markObject(rope->right);
+            markObject((Obj*) rope->flat);
+            break;
+        }
         case OBJ_NATIVE:
         case OBJ_STRING:
             break;
@@ -97,79 +114,108 @@ static void traceReferences() {
     }
 }
 
+static void releaseObjectMemory(Obj* object, size_t size) {
+    vm.bytesAllocated -= size;
+    if (arenaContains(object)) {
+        object->isAllocated = false;
+        return;
+    }
+    cageFree(object, size);
+}
+
 static void freeObject(Obj* object) {
     if (DEBUG_LOG_GC){
         printf("%p free type %d\n", (void*) object, object->type);
     }
     switch (object->type) {
         case OBJ_BOUND_METHOD: {
-            free<ObjBoundMethod>((ObjBoundMethod*) object);
+            releaseObjectMemory(object, sizeof(ObjBoundMethod));
             break;
         }
         case OBJ_CLASS: {
             ObjClass* klass = (ObjClass*) object;
             freeTable(&klass->methods);
-            free<ObjClass>(klass);
+            freeTable(&klass->methodCache);
+            releaseObjectMemory(object, sizeof(ObjClass));
             break;
         }
         case OBJ_CLOSURE: {
             ObjClosure* closure = (ObjClosure*) object;
-            freeArray<ObjUpvalue*>(closure->upvalues, closure->upvalueCount);
-            free<ObjUpvalue>((ObjUpvalue*) object);
+            releaseObjectMemory(object, sizeof(ObjClosure) + sizeof(Value) * closure->upvalueCount);
             break;
         }
         case OBJ_FUNCTION: {
             ObjFunction* function = (ObjFunction*) object;
             freeChunk(&function->chunk);
-            free<Obj>(object);
+            freeArray<Upvalue>(function->upvalues, function->upvalueCount);
+            if (function->lazy != NULL) {
+                vmHooks.freeLazyFunction(function);
+            }
+            releaseObjectMemory(object, sizeof(ObjFunction));
             break;
         }
         case OBJ_INSTANCE: {
             ObjInstance* instance = (ObjInstance*)object;
             freeTable(&instance->fields);
-            free<ObjInstance>(instance);
+            releaseObjectMemory(object, sizeof(ObjInstance));
             break;
         }
         case OBJ_NATIVE: {
-            free<ObjNative>((ObjNative*) object);
+            releaseObjectMemory(object, sizeof(ObjNative));
             break;
         }
         case OBJ_STRING: {
             ObjString* string = (ObjString*) object;
-            freeArray<char>(string->chars, string->length + 1);
-            free<Obj>(object);
+            releaseObjectMemory(object, sizeof(ObjString) + string->length + 1);
             break;
         }
         case OBJ_UPVALUE: {
-            free<ObjUpvalue>((ObjUpvalue*) object);
+            releaseObjectMemory(object, sizeof(ObjUpvalue));
+            break;
+        }
+        case OBJ_ROPE: {
+            releaseObjectMemory(object, sizeof(ObjRope));
+            break;
         }
     }
 }
 
 
-static void sweep() {
-    Obj* previous = NULL;
-    Obj* object = vm.objects;
-    while (object != NULL) {
-        if (object->isMarked) {
-            object->isMarked = false;
-            previous = object;
-            object = object->next;
-        } else{
-            Obj* unreached = object;
-            object = object->next;
-            if (previous != NULL) {
-                previous->next = object;
-            } else{
-                vm.objects = object;
-            }
+void forEachObject(ObjectVisitor visit, void* context) {
+    arenaForEachObject(visit, context);
+    cageForEachObject(visit, context);
+}
 
-            freeObject(unreached);
-        }
+static void sweepObject(Obj* object, void* context) {
+    if (object->isMarked) {
+        object->isMarked = false;
+    } else {
+        freeObject(object);
+    }
+}
+
+static void releaseObject(Obj* object, void* context) {
+    freeObject(object);
+}
+
+static void sweep() {
+    forEachObject(sweepObject, NULL);
+    // Scoped instances aren't part of the heap walk but still get marked.
+    for (int i = 0; i < vm.scopedCount; i++) {
+        vm.scopedInstances[i].obj.isMarked = false;
     }
 }
 
 void collectGarbage() {
+    // tableCompact() below allocates, which must not start another cycle.
+    static bool collecting = false;
+    if (vm.arenaMode || collecting) {
+        return;
+    }
+    collecting = true;
+    if (vmHooks.beforeFree != NULL) {
+        vmHooks.beforeFree();
+    }
     size_t before = vm.bytesAllocated;
     if (DEBUG_LOG_GC){
         printf("-- gc begin\n");
@@ -179,14 +225,19 @@ void collectGarbage() {
     traceReferences();
     tableRemoveWhite(&vm.strings);
     sweep();
+    tableCompact(&vm.strings);
 
     vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+    if (vm.nextGC < GC_MIN_HEAP) {
+        vm.nextGC = GC_MIN_HEAP;
+    }
 
     if (DEBUG_LOG_GC){
         printf("--gc end\n");
         printf("  collected %zu bytes (from %zu to %zu) next at %zu\n",
             before - vm.bytesAllocated, before, vm.bytesAllocated, vm.nextGC);  
     }
+    collecting = false;
 }
 
 void markObject(Obj* object) {
@@ -213,10 +264,9 @@ void markObject(Obj* object) {
     vm.grayStack[vm.grayCount++] = object;
 }
 
-void *reallocate(void *pointer, size_t oldSize, size_t newSize)
-{
+static void accountAllocation(size_t oldSize, size_t newSize) {
     vm.bytesAllocated += newSize - oldSize;
-    if (newSize > oldSize) {
+    if (newSize > oldSize && !vm.arenaMode) {
         if (DEBUG_STRESS_GC){
             collectGarbage();
         }
@@ -225,6 +275,11 @@ void *reallocate(void *pointer, size_t oldSize, size_t newSize)
             collectGarbage();
         }
     }
+}
+
+void *reallocate(void *pointer, size_t oldSize, size_t newSize)
+{
+    accountAllocation(oldSize, newSize);
 
     if (newSize == 0)
     {
@@ -240,13 +295,41 @@ void *reallocate(void *pointer, size_t oldSize, size_t newSize)
     return result;
 }
 
+static void* allocateCollectedObject(size_t size) {
+    accountAllocation(0, size);
+    return cageAllocate(size);
+}
+
+void* allocateObjectMemory(size_t size) {
+    if (!vm.arenaMode) {
+        return allocateCollectedObject(size);
+    }
+
+    void* result = arenaAllocate(size);
+    if (result != NULL) {
+        vm.bytesAllocated += size;
+        return result;
+    }
+
+    if (vm.arenaFallback == ARENA_FALLBACK_FAIL) {
+        fprintf(stderr, "Arena limit of %zu bytes exceeded.\n", vm.arenaLimit);
+        exit(70);
+    }
+    vm.arenaMode = false;
+    return allocateCollectedObject(size);
+}
+
 void freeObjects() {
-    Obj* object = vm.objects;
-    while (object != NULL) {
-        Obj* next = object->next;
-        freeObject(object);
-        object = next;
+    if (vm.arenaMode) {
+        freeArena();
+        freeCage();
+        free(vm.grayStack);
+        return;
     }
 
+    forEachObject(releaseObject, NULL);
+
+    freeArena();
+    freeCage();
     free(vm.grayStack);
 }
@@ -8,6 +8,8 @@
 int growCapacity(int capacity);
 
 void *reallocate(void *pointer, size_t oldSize, size_t newSize);
+void* allocateObjectMemory(size_t size);
+void forEachObject(ObjectVisitor visit, void* context);
 void markObject(Obj* object);
 
 void markValue(Value value);
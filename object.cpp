@@ -1,16 +1,16 @@
 #include <stdio.h>
 #include <string.h>
+#include <string>
+#include <vector>
 #include "memory.h"
 #include "object.h"
 #include "value.h"
 #include "vm.h"
 #include "table.h"
 
-static ObjString* allocateString(char* chars, int length, uint32_t hash) {
-    ObjString* string = allocateObj<ObjString>(OBJ_STRING);
-    string->length = length;
-    string->chars = chars;
-    string->hash = hash;
+static ObjString* internString(ObjString* string, uint32_t hash) {
+    string->obj.hash = hash;
+    string->obj.isInterned = true;
 
     push(objVal((Obj*) string));
     tableSet(&vm.strings, string, nilVal());
@@ -18,7 +18,32 @@ static ObjString* allocateString(char* chars, int length, uint32_t hash) {
     return string;
 }
 
+const int HASH_WORD_LENGTH = 16;
+
+// Long strings are hashed eight bytes at a time and the result folded down
+// to 32 bits.
+static uint32_t hashLongString(const char* key, int length) {
+    uint64_t hash = 14695981039346656037ull ^ (uint64_t) length;
+    int i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, key + i, sizeof(word));
+        hash = (hash ^ word) * 0x9e3779b97f4a7c15ull;
+        hash ^= hash >> 32;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, key + i, length - i);
+    hash = (hash ^ tail) * 0x9e3779b97f4a7c15ull;
+    hash ^= hash >> 29;
+    hash *= 0xbf58476d1ce4e5b9ull;
+    hash ^= hash >> 32;
+    return (uint32_t) hash;
+}
+
 static uint32_t hashString(const char* key, int length) {
+    if (length >= HASH_WORD_LENGTH) {
+        return hashLongString(key, length);
+    }
     uint32_t hash = 2166136261u;
     for (int i = 0; i < length; i++){
         hash ^= (uint8_t) key[i];
@@ -27,6 +52,16 @@ static uint32_t hashString(const char* key, int length) {
     return hash;
 }
 
+// Allocates an uninterned, unhashed string with room for length characters
+// right after the header. Runtime strings stay that way unless they are passed
+// to takeString(), which is only needed to use one as a table key.
+ObjString* makeString(int length) {
+    ObjString* string = (ObjString*) allocateObject(sizeof(ObjString) + length + 1, OBJ_STRING);
+    string->length = length;
+    string->chars[length] = '\0';
+    return string;
+}
+
 ObjString* copyString(const char* chars, int length) {
     uint32_t hash = hashString(chars, length);
     ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
@@ -35,30 +70,108 @@ ObjString* copyString(const char* chars, int length) {
         return interned;
     }
 
-    char* heapChars = allocate<char>(length + 1);
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
-    return allocateString(heapChars, length, hash);
+    ObjString* string = makeString(length);
+    memcpy(string->chars, chars, length);
+    return internString(string, hash);
 }
 
 ObjUpvalue* newUpvalue(Value* slot) {
     ObjUpvalue* upvalue = allocateObj<ObjUpvalue>(OBJ_UPVALUE);
     upvalue->closed = nilVal();
     upvalue->location = slot;
-    upvalue->next =NULL;
     return upvalue;
 }
 
-ObjString* takeString(char* chars, int length) {
-    uint32_t hash = hashString(chars, length);
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+// Interns a string built with makeString(). If an equal string already exists
+// that one is returned and the new object is left for the collector.
+ObjString* takeString(ObjString* string) {
+    if (string->obj.isInterned) {
+        return string;
+    }
+    uint32_t hash = hashString(string->chars, string->length);
+    ObjString* interned = tableFindString(&vm.strings, string->chars, string->length, hash);
 
     if (interned != NULL) {
-        freeArray<char>(chars, length + 1);
         return interned;
     }
 
-    return allocateString(chars, length, hash);
+    return internString(string, hash);
+}
+
+// Use a flattened rope's string directly so chains do not grow through it.
+static Obj* ropeOperand(Obj* object) {
+    if (object->type == OBJ_ROPE && ((ObjRope*) object)->flat != NULL) {
+        return (Obj*) ((ObjRope*) object)->flat;
+    }
+    return object;
+}
+
+static int objectLength(Obj* object) {
+    return object->type == OBJ_ROPE ? ((ObjRope*) object)->length : ((ObjString*) object)->length;
+}
+
+ObjRope* newRope(Obj* left, Obj* right) {
+    ObjRope* rope = allocateObj<ObjRope>(OBJ_ROPE);
+    rope->left = ropeOperand(left);
+    rope->right = ropeOperand(right);
+    rope->length = objectLength(left) + objectLength(right);
+    rope->flat = NULL;
+    return rope;
+}
+
+// Copies the characters of a rope so that they end at end. Works from the
+// right with an explicit stack, so ropes built by appending in a loop need no
+// recursion and only a couple of pending nodes.
+static void copyRopeChars(ObjRope* rope, char* end) {
+    std::vector<Obj*> pending;
+    pending.push_back((Obj*) rope);
+    while (!pending.empty()) {
+        Obj* node = ropeOperand(pending.back());
+        pending.pop_back();
+        if (node->type == OBJ_ROPE) {
+            pending.push_back(((ObjRope*) node)->left);
+            pending.push_back(((ObjRope*) node)->right);
+            continue;
+        }
+        ObjString* leaf = (ObjString*) node;
+        end -= leaf->length;
+        memcpy(end, leaf->chars, leaf->length);
+    }
+}
+
+ObjString* flattenRope(ObjRope* rope) {
+    if (rope->flat != NULL) {
+        return rope->flat;
+    }
+    push(objVal((Obj*) rope));
+    ObjString* string = makeString(rope->length);
+    copyRopeChars(rope, string->chars + rope->length);
+    rope->flat = string;
+    rope->left = NULL;
+    rope->right = NULL;
+    pop();
+    return rope->flat;
+}
+
+int stringLength(Value value) {
+    return objectLength(asObj(value));
+}
+
+// Interned strings are equal only if identical; anything else is compared by
+// content. Ropes are flattened first, so both values must be GC roots.
+bool stringsEqual(Value a, Value b) {
+    if (stringLength(a) != stringLength(b)) {
+        return false;
+    }
+    ObjString* left = asString(a);
+    ObjString* right = asString(b);
+    if (left == right) {
+        return true;
+    }
+    if (left->obj.isInterned && right->obj.isInterned) {
+        return false;
+    }
+    return memcmp(left->chars, right->chars, left->length) == 0;
 }
 
 static void printFunction(ObjFunction* function){
@@ -95,16 +208,33 @@ void printObject(Value value) {
         case OBJ_UPVALUE:
             printf("upvalue");
             break;
+        case OBJ_ROPE: {
+            // Printing must not allocate on the GC heap, it is also used by
+            // the GC log and the execution trace.
+            ObjRope* rope = (ObjRope*) asObj(value);
+            if (rope->flat != NULL) {
+                printf("%s", rope->flat->chars);
+                break;
+            }
+            std::string text(rope->length, '\0');
+            copyRopeChars(rope, &text[0] + rope->length);
+            printf("%s", text.c_str());
+            break;
+        }
     }
 }
 
-static Obj* allocateObject(size_t size, ObjType type){
-    Obj* object = (Obj*) reallocate(NULL, 0, size);
+static void initObjectHeader(Obj* object, ObjType type) {
     object->type = type;
     object->isMarked = false;
+    object->isAllocated = true;
+    object->isInterned = false;
+    object->hash = 0;
+}
 
-    object->next = vm.objects;
-    vm.objects = object;
+static Obj* allocateObject(size_t size, ObjType type){
+    Obj* object = (Obj*) allocateObjectMemory(size);
+    initObjectHeader(object, type);
 
     if (DEBUG_LOG_GC){
         printf("%p allocate %zu for %d\n", (void*) object, size, type);
@@ -113,6 +243,22 @@ static Obj* allocateObject(size_t size, ObjType type){
     return object;
 }
 
+size_t objectSize(Obj* object) {
+    switch (object->type) {
+        case OBJ_BOUND_METHOD: return sizeof(ObjBoundMethod);
+        case OBJ_CLASS: return sizeof(ObjClass);
+        case OBJ_CLOSURE:
+            return sizeof(ObjClosure) + sizeof(Value) * ((ObjClosure*) object)->upvalueCount;
+        case OBJ_FUNCTION: return sizeof(ObjFunction);
+        case OBJ_INSTANCE: return sizeof(ObjInstance);
+        case OBJ_NATIVE: return sizeof(ObjNative);
+        case OBJ_STRING: return sizeof(ObjString) + ((ObjString*) object)->length + 1;
+        case OBJ_UPVALUE: return sizeof(ObjUpvalue);
+        case OBJ_ROPE: return sizeof(ObjRope);
+    }
+    return 0;
+}
+
 ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method) {
     ObjBoundMethod* bound = allocateObj<ObjBoundMethod>(OBJ_BOUND_METHOD);
     bound->receiver = receiver;
@@ -127,22 +273,36 @@ ObjInstance* newInstance(ObjClass* klass){
     return instance;
 }
 
+// Builds an instance in memory the collector doesn't own. The caller frees
+// its fields and decides when the memory is reused.
+ObjInstance* placeInstance(void* memory, ObjClass* klass) {
+    ObjInstance* instance = (ObjInstance*) memory;
+    initObjectHeader((Obj*) instance, OBJ_INSTANCE);
+    instance->klass = klass;
+    initTable(&instance->fields);
+    return instance;
+}
+
 ObjClass* newClass(ObjString* name) {
     ObjClass* klass = allocateObj<ObjClass>(OBJ_CLASS);
     klass->name = name;
+    klass->superclass = NULL;
+    klass->initializer = NULL;
+    klass->fieldCount = 0;
     initTable(&klass->methods);
+    initTable(&klass->methodCache);
     return klass;
 }
 
 ObjClosure* newClosure(ObjFunction* function){
-    ObjUpvalue** upvalues = allocate<ObjUpvalue*>(function->upvalueCount);
-    for (int i = 0; i < function->upvalueCount; i++) {
-        upvalues[i] = NULL;
-    }
-    ObjClosure* closure = allocateObj<ObjClosure>(OBJ_CLOSURE);
+    int upvalueCount = function->upvalueCount;
+    ObjClosure* closure = (ObjClosure*) allocateObject(
+        sizeof(ObjClosure) + sizeof(Value) * upvalueCount, OBJ_CLOSURE);
     closure->function = function;
-    closure->upvalues = upvalues;
-    closure->upvalueCount = function->upvalueCount;
+    closure->upvalueCount = upvalueCount;
+    for (int i = 0; i < upvalueCount; i++) {
+        closure->upvalues[i] = nilVal();
+    }
     return closure;
 }
 
@@ -151,6 +311,9 @@ ObjFunction* newFunction() {
     function->arity = 0;
     function->upvalueCount = 0;
     function->name = NULL;
+    function->upvalues = NULL;
+    function->thisEscapes = true;
+    function->lazy = NULL;
     initChunk(&function->chunk);
     return function;
 }
@@ -206,10 +369,14 @@ NativeFn asNative(Value value){
 }
 
 bool isString(Value value){
-    return isObjType(value, OBJ_STRING);
+    return isObjType(value, OBJ_STRING) || isObjType(value, OBJ_ROPE);
 }
 
+// Ropes are flattened here, which may allocate.
 ObjString* asString(Value value){
+    if (objType(value) == OBJ_ROPE) {
+        return flattenRope((ObjRope*) asObj(value));
+    }
     return (ObjString*) asObj(value);
 }
 
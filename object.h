@@ -10,21 +10,43 @@ typedef enum {
     OBJ_INSTANCE,
     OBJ_NATIVE,
     OBJ_STRING,
-    OBJ_UPVALUE
+    OBJ_UPVALUE,
+    OBJ_ROPE
 } ObjType;
 
+// A single header word. Strings keep their hash in it; the GC finds objects
+// by walking the allocator, so there is no list link.
 struct Obj {
-    ObjType type;
-    bool isMarked;
-    struct Obj* next;
+    ObjType type : 8;
+    bool isMarked : 1;
+    bool isAllocated : 1;
+    bool isInterned : 1;
+    uint32_t hash;
 };
 
+static_assert(sizeof(Obj) == 8, "object header should be one word");
+
+// Where a closure finds each upvalue when it is created: a local slot of the
+// enclosing frame or one of the enclosing closure's upvalues. A local that is
+// never assigned after its declaration is copied into the closure instead of
+// being boxed in an ObjUpvalue.
+typedef struct {
+    uint8_t index;
+    bool isLocal;
+    bool isCopy;
+} Upvalue;
+
 typedef struct {
     Obj obj;
     int arity;
     int upvalueCount;
     Chunk chunk;
-    ObjString* name;
+    Ref<ObjString> name;
+    Upvalue* upvalues;
+    // Cleared for initializers that only use this to get at its fields.
+    bool thisEscapes;
+    // Set while the body still has to be compiled, see compileLazyFunction().
+    struct LazyFunction* lazy;
 } ObjFunction;
 
 typedef Value (*NativeFn) (int argCount, Value* args);
@@ -37,44 +59,70 @@ typedef struct {
 struct ObjString {
     Obj obj;
     int length;
-    char* chars;
-    uint32_t hash;
+    char chars[];
 };
 
+// Concatenations at least this long build a rope instead of copying. Shorter
+// results are plain strings that are not interned.
+const int ROPE_MIN_LENGTH = 64;
+
+// The result of a concatenation that has not been copied yet. left and right
+// are strings or ropes. Flattening copies the characters into flat and drops
+// the children.
+typedef struct {
+    Obj obj;
+    int length;
+    Ref<Obj> left;
+    Ref<Obj> right;
+    Ref<ObjString> flat;
+} ObjRope;
+
 typedef struct ObjUpvalue {
     Obj obj;
     Value* location;
     Value closed;
-    struct ObjUpvalue* next;
 } ObjUpvalue;
 
+// The upvalues live right after the closure in the same allocation. Each one
+// is either the captured value itself or an ObjUpvalue box, as the function's
+// Upvalue descriptors say.
 typedef struct {
     Obj obj;
-    ObjFunction* function;
-    ObjUpvalue** upvalues;
+    Ref<ObjFunction> function;
     int upvalueCount;
+    Value upvalues[];
 } ObjClosure;
 
-typedef struct {
+// methods only holds the class's own methods. Inherited ones are found by
+// walking superclass and remembered in methodCache. initializer is the init
+// method the class would find, own or inherited, or NULL. fieldCount is the
+// most fields any instance has had so far; new instances start with room for
+// that many.
+typedef struct ObjClass {
     Obj obj;
-    ObjString* name;
+    Ref<ObjString> name;
+    Ref<struct ObjClass> superclass;
+    Ref<ObjClosure> initializer;
+    int fieldCount;
     Table methods;
+    Table methodCache;
 } ObjClass;
 
 typedef struct {
     Obj obj;
-    ObjClass* klass;
+    Ref<ObjClass> klass;
     Table fields;
 } ObjInstance;
 
 typedef struct {
     Obj obj;
     Value receiver;
-    ObjClosure* method;
+    Ref<ObjClosure> method;
 } ObjBoundMethod;
 
 ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method);
 ObjInstance* newInstance(ObjClass* klass);
+ObjInstance* placeInstance(void* memory, ObjClass* klass);
 ObjClass* newClass(ObjString* name);
 ObjClosure* newClosure(ObjFunction* function);
 ObjFunction* newFunction();
@@ -108,7 +156,13 @@ ObjType objType(Value value);
 bool isString(Value value);
 ObjString* asString(Value value);
 char* asCstring(Value value);
-ObjString* takeString(char* chars, int length);
+ObjString* makeString(int length);
+ObjRope* newRope(Obj* left, Obj* right);
+ObjString* flattenRope(ObjRope* rope);
+int stringLength(Value value);
+bool stringsEqual(Value a, Value b);
+ObjString* takeString(ObjString* string);
 ObjString* copyString(const char* chars, int length);
 ObjUpvalue* newUpvalue(Value* slot);
+size_t objectSize(Obj* object);
 void printObject(Value value);
\ No newline at end of file
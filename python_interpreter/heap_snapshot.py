@@ -0,0 +1,98 @@
+import sys
+import typing
+from collections import deque
+from dataclasses import dataclass, field
+
+
+@dataclass
+class HeapNode:
+    id: int
+    type: str
+    shallow: int
+    retained: int
+    dominator: int
+    name: str
+    edges: typing.List[typing.Tuple[int, str]] = field(default_factory=list)
+
+
+def load_snapshot(path: str) -> typing.Dict[int, HeapNode]:
+    nodes = {}
+    edges = []
+    with open(path) as f:
+        for line in f:
+            if line.startswith("node "):
+                parts = line.rstrip("\n").split(" ", 6)
+                node_id = int(parts[1])
+                nodes[node_id] = HeapNode(node_id, parts[2], int(parts[3]), int(parts[4]),
+                                          int(parts[5]), parts[6] if len(parts) > 6 else "")
+            elif line.startswith("edge "):
+                parts = line.rstrip("\n").split(" ", 3)
+                edges.append((int(parts[1]), int(parts[2]), parts[3] if len(parts) > 3 else ""))
+    for source, target, label in edges:
+        nodes[source].edges.append((target, label))
+    return nodes
+
+
+def retainer_path(nodes: typing.Dict[int, HeapNode], target: int):
+    """Shortest chain of references from the roots to target."""
+    parents = {0: None}
+    queue = deque([0])
+    while queue:
+        node_id = queue.popleft()
+        if node_id == target:
+            break
+        for successor, label in nodes[node_id].edges:
+            if successor not in parents:
+                parents[successor] = (node_id, label)
+                queue.append(successor)
+    if target not in parents:
+        return None
+    path = []
+    node_id = target
+    while parents[node_id] is not None:
+        parent, label = parents[node_id]
+        path.append((parent, label, node_id))
+        node_id = parent
+    return list(reversed(path))
+
+
+def describe(node: HeapNode) -> str:
+    return f'#{node.id} {node.type} "{node.name}"'
+
+
+def print_top(nodes: typing.Dict[int, HeapNode], count: int):
+    ranked = sorted((n for n in nodes.values() if n.id != 0), key=lambda n: n.retained, reverse=True)
+    print(f'{"retained":>12} {"shallow":>10}  object')
+    for node in ranked[:count]:
+        print(f'{node.retained:>12} {node.shallow:>10}  {describe(node)}')
+
+
+def print_retainers(nodes: typing.Dict[int, HeapNode], target: int):
+    path = retainer_path(nodes, target)
+    if path is None:
+        print(f'#{target} is not reachable from the roots')
+        return
+    print("(roots)")
+    for _, label, child in path:
+        print(f'  --[{label}]--> {describe(nodes[child])}')
+    print("dominators:")
+    node_id = nodes[target].dominator
+    while node_id > 0:
+        print(f'  {describe(nodes[node_id])} retains {nodes[node_id].retained} bytes')
+        node_id = nodes[node_id].dominator
+
+
+def main():
+    if len(sys.argv) < 2:
+        print("Usage: heap_snapshot.py <snapshot> [--top N | --retainers ID]")
+        return
+    nodes = load_snapshot(sys.argv[1])
+    if len(sys.argv) >= 4 and sys.argv[2] == "--retainers":
+        print_retainers(nodes, int(sys.argv[3]))
+    else:
+        count = int(sys.argv[3]) if len(sys.argv) >= 4 and sys.argv[2] == "--top" else 20
+        print_top(nodes, count)
+
+
+if __name__ == "__main__":
+    main()
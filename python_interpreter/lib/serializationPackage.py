@@ -45,6 +45,9 @@ class ContextOpcode(betterproto.Enum):
     OP_GET_SUPER = 34
     OP_SUPER_INVOKE = 35
     OP_METHOD = 36
+    OP_GET_CAPTURED = 37
+    OP_CALL_SCOPED = 38
+    OP_POP_SCOPED = 39
     OP_PLACEHOLDER = 255
 
 
@@ -96,3 +99,31 @@ class ValueType(betterproto.Message):
     string_address: int = betterproto.int64_field(2, group="ValueTypes")
     num_val: float = betterproto.double_field(3, group="ValueTypes")
     bool_val: bool = betterproto.bool_field(4, group="ValueTypes")
+
+
+@dataclass
+class VMDataV2(betterproto.Message):
+    version: int = betterproto.uint32_field(1)
+    strings: List[str] = betterproto.string_field(2)
+    functions: List["FunctionV2"] = betterproto.message_field(3)
+    script: int = betterproto.uint32_field(4)
+    operand_bytes: List[int] = betterproto.uint32_field(5)
+
+
+@dataclass
+class FunctionV2(betterproto.Message):
+    name: int = betterproto.sint32_field(1)
+    arity: int = betterproto.uint32_field(2)
+    upvalue_count: int = betterproto.uint32_field(3)
+    code: bytes = betterproto.bytes_field(4)
+    lines: List[int] = betterproto.uint32_field(5)
+    constants: List["ConstantV2"] = betterproto.message_field(6)
+    this_does_not_escape: bool = betterproto.bool_field(7)
+
+
+@dataclass
+class ConstantV2(betterproto.Message):
+    number: float = betterproto.double_field(1, group="value")
+    boolean: bool = betterproto.bool_field(2, group="value")
+    string_index: int = betterproto.uint32_field(3, group="value")
+    function_index: int = betterproto.uint32_field(4, group="value")
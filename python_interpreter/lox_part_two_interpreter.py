@@ -5,7 +5,6 @@ import sys
 import types
 import typing
 import operator
-import betterproto
 from lib import serializationPackage as sp
 from vm_data_generator import VMRuntimeReadOnlyData, VMRuntimeWriteOnlyData, \
  CallStackSingleElement, RuntimeClosure, generate_vm_data, new_closure, LoxClass, LoxInstance, RuntimeBoundMethod
@@ -15,58 +14,11 @@ CALL_STACK_MAX = 100
 def is_falsey(value):
     return value is None or value == False
 
-def read_byte(vm_read_only: VMRuntimeReadOnlyData, call_stack: CallStackSingleElement):
-    context: sp.Context = vm_read_only.contextmap[call_stack.funcPointer]
-    instruction_counter = call_stack.ip
-    instruction_value = None
-    if (betterproto.which_one_of(context.instruction_vals[instruction_counter], "InstructionTypes")[0] == 'opcode'):
-        instruction_value = context.instruction_vals[instruction_counter].opcode
-    elif (betterproto.which_one_of(context.instruction_vals[instruction_counter], "InstructionTypes")[0] == 'address_or_constant'):
-        instruction_value = context.instruction_vals[instruction_counter].address_or_constant
-    else:
-        print("Error: incorrect type found!")
-    return instruction_value, instruction_counter + 1 
-
-def read_constant(vm_read_only: VMRuntimeReadOnlyData, call_stack: CallStackSingleElement):
-    byte_num, instruction_counter = read_byte(vm_read_only, call_stack)
-    context: sp.Context =  vm_read_only.contextmap[call_stack.funcPointer]
-    current_value = context.constant_vals[byte_num]
-    # breakpoint()
-    if (betterproto.which_one_of(current_value, "ValueTypes")[0] == 'string_address'):
-        return (vm_read_only.stringmap[current_value.string_address], instruction_counter)
-    elif (betterproto.which_one_of(current_value, "ValueTypes")[0] == 'function_address'):
-        return (vm_read_only.contextmap[current_value.function_address], instruction_counter)
-    elif (betterproto.which_one_of(current_value, "ValueTypes")[0] == 'num_val'):
-        return (current_value.num_val, instruction_counter)
-    elif (betterproto.which_one_of(current_value, "ValueTypes")[0] == 'bool_val'):
-        return (current_value.bool_val, instruction_counter)
-
-def read_short(vm_read_only: VMRuntimeReadOnlyData, call_stack: CallStackSingleElement):
-    new_instruction_counter = call_stack.ip + 2
-    context: sp.Context =  vm_read_only.contextmap[call_stack.funcPointer]
-
-    second_last_instruction = context.instruction_vals[new_instruction_counter - 2].address_or_constant if \
-        betterproto.which_one_of(context.instruction_vals[new_instruction_counter - 2], "InstructionTypes")[0] == 'address_or_constant' \
-        else context.instruction_vals[new_instruction_counter - 2].opcode
-
-    first_value = second_last_instruction << 8 
-
-    last_instruction = context.instruction_vals[new_instruction_counter - 1].address_or_constant if \
-        betterproto.which_one_of(context.instruction_vals[new_instruction_counter - 1], "InstructionTypes")[0] == 'address_or_constant' \
-        else context.instruction_vals[new_instruction_counter - 1].opcode
-
-    second_value = first_value | last_instruction
-    return second_value, new_instruction_counter
-
-def read_string(vmdata:sp.VMData, current: int):
-    return read_constant(vmdata, current)
-
 def runtimeError(instruction_text: str, vmRuntimeReadOnlyData: VMRuntimeReadOnlyData, 
         call_stack: typing.List[CallStackSingleElement]):
     print(f'[error: {instruction_text}] in script')
     for i in reversed(range(len(call_stack))):
-        context_pointer = call_stack[i].funcPointer
-        context_function_name = vmRuntimeReadOnlyData.contextmap[context_pointer].context_name 
+        context_function_name = call_stack[i].function.name
         if (context_function_name == None):
             print("script\n")
         else:
@@ -92,195 +44,220 @@ def concatenate(str1: str, str2: str):
     return total_str
 
 
+# Each handler takes (read only data, write only data, current frame, stack,
+# operand, extra) and returns False on a runtime error, True once the script
+# returns and None to carry on.
+
+def op_constant(read_only, write_only, frame, data_stack, operand, extra):
+    data_stack.append(operand)
+
+def op_print(read_only, write_only, frame, data_stack, operand, extra):
+    print(data_stack.pop())
+
+def op_closure(read_only, write_only, frame, data_stack, operand, extra):
+    closure = new_closure(operand)
+    data_stack.append(closure)
+    for is_local, index in extra: #TODO: Potential for a bug to live here
+        if (is_local > 0):
+            closure.upvalues.append(data_stack[frame.slot_offset + index])
+        else:
+            closure.upvalues.append(frame.upvalues[index])
+
+def op_get_upvalue(read_only, write_only, frame, data_stack, operand, extra):
+    data_stack.append(frame.upvalues[operand])
+
+def op_set_upvalue(read_only, write_only, frame, data_stack, operand, extra):
+    frame.upvalues[operand] = data_stack[-1] #TODO: Fix
+
+def op_return(read_only, write_only, frame, data_stack, operand, extra):
+    result = data_stack.pop()
+    write_only.callstack.pop()
+    if len(write_only.callstack) == 0:
+        data_stack.pop()
+        return True
+    del data_stack[frame.slot_offset:]
+    data_stack.append(result)
+
+def op_nil(read_only, write_only, frame, data_stack, operand, extra):
+    data_stack.append(None)
+
+def op_true(read_only, write_only, frame, data_stack, operand, extra):
+    data_stack.append(True)
+
+def op_false(read_only, write_only, frame, data_stack, operand, extra):
+    data_stack.append(False)
+
+def op_get_global(read_only, write_only, frame, data_stack, name, extra):
+    if (name not in write_only.global_data):
+        runtimeError(f'Undefined variable \'{name}\'.', read_only, write_only.callstack)
+        return False
+    data_stack.append(write_only.global_data[name])
+
+def op_define_global(read_only, write_only, frame, data_stack, name, extra):
+    write_only.global_data[name] = data_stack.pop()
+
+def op_set_global(read_only, write_only, frame, data_stack, name, extra):
+    if (name not in write_only.global_data):
+        runtimeError(f'Undefined variable \'{name}\'.', read_only, write_only.callstack)
+        return False
+    write_only.global_data[name] = data_stack[-1]
+
+def op_get_property(read_only, write_only, frame, data_stack, name, extra):
+    instance = data_stack[-1]
+
+    if not isinstance(instance, LoxInstance):
+        runtimeError("Only instances have properties.")
+        return False
+
+    if (name in instance.fields):
+        value = instance.fields[name]
+        data_stack.pop()
+        data_stack.append(value)
+    else:
+        if (not bind_method(instance.klass, name, data_stack)):
+            return False
+
+def op_set_property(read_only, write_only, frame, data_stack, name, extra):
+    instance = data_stack[-2]
+    instance.fields[name] = data_stack[-1]
+    value = data_stack.pop()
+    data_stack.pop()
+    data_stack.append(value)
+
+def op_get_local(read_only, write_only, frame, data_stack, slot, extra):
+    data_stack.append(data_stack[frame.slot_offset + slot])
+
+def op_set_local(read_only, write_only, frame, data_stack, slot, extra):
+    data_stack[frame.slot_offset + slot] = data_stack[-1]
+
+def binary_op_handler(passed_func, the_type):
+    def op_binary(read_only, write_only, frame, data_stack, operand, extra):
+        if (binaryOp(read_only, write_only.callstack, data_stack, passed_func, the_type) == False):
+            return False
+    return op_binary
+
+def op_not(read_only, write_only, frame, data_stack, operand, extra):
+    data_stack.append(is_falsey(data_stack.pop()))
+
+def op_negate(read_only, write_only, frame, data_stack, operand, extra):
+    if type(data_stack[-1]) != float:
+        runtimeError("Operand must be a number.", read_only, write_only.callstack)
+        return False
+    data_stack.append(-(data_stack.pop()))
+
+def op_pop(read_only, write_only, frame, data_stack, operand, extra):
+    data_stack.pop()
+
+def op_equal(read_only, write_only, frame, data_stack, operand, extra):
+    b = data_stack.pop()
+    a = data_stack.pop()
+    data_stack.append(a == b)
+
+def op_add(read_only, write_only, frame, data_stack, operand, extra):
+    if type(data_stack[-1]) == str and type(data_stack[-2]) == str:
+        val_2 = data_stack.pop()
+        val_1 = data_stack.pop()
+        data_stack.append(concatenate(val_1, val_2))
+    elif type(data_stack[-1]) == float and type(data_stack[-2]) == float:
+        data_stack.append(data_stack.pop() + data_stack.pop())
+    else:
+        runtimeError("Operands must be two numbers or two strings.", read_only, write_only.callstack)
+        return False
+
+def op_jump(read_only, write_only, frame, data_stack, target, extra):
+    frame.ip = target
+
+def op_jump_if_false(read_only, write_only, frame, data_stack, target, extra):
+    if is_falsey(data_stack[-1]):
+        frame.ip = target
+
+def op_call(read_only, write_only, frame, data_stack, arg_count, extra):
+    if (not call_value(read_only, write_only.callstack, data_stack, data_stack[-(arg_count + 1)], arg_count)):
+        return False
+
+def op_class(read_only, write_only, frame, data_stack, class_name, extra):
+    data_stack.append(LoxClass(class_name, {}))
+
+def op_method(read_only, write_only, frame, data_stack, name, extra):
+    define_method(name, data_stack)
+
+def op_invoke(read_only, write_only, frame, data_stack, method, arg_count):
+    if not invoke(read_only, method, arg_count, write_only.callstack, data_stack):
+        return False
+
+def op_inherit(read_only, write_only, frame, data_stack, operand, extra):
+    superclass = data_stack[-2]
+    subclass = data_stack[-1]
+    for method in superclass.methods.items():
+        subclass.methods[method[0]] = method[1]
+    data_stack.pop()
+
+def op_get_super(read_only, write_only, frame, data_stack, name, extra):
+    superclass = data_stack.pop()
+    if (not bind_method(superclass, name, data_stack)):
+        return False
+
+def op_super_invoke(read_only, write_only, frame, data_stack, method, arg_count):
+    superclass = data_stack.pop()
+    if not invoke_from_klass(read_only, superclass, method, arg_count, write_only.callstack, data_stack):
+        return False
+
+def op_skip(read_only, write_only, frame, data_stack, operand, extra):
+    pass
+
+# Indexed by opcode. Opcodes the replay doesn't implement, and the placeholder
+# bytes the compiler leaves after some jumps, do nothing.
+DISPATCH = [op_skip] * 256
+DISPATCH[sp.ContextOpcode.OP_CONSTANT] = op_constant
+DISPATCH[sp.ContextOpcode.OP_PRINT] = op_print
+DISPATCH[sp.ContextOpcode.OP_CLOSURE] = op_closure
+DISPATCH[sp.ContextOpcode.OP_GET_UPVALUE] = op_get_upvalue
+DISPATCH[sp.ContextOpcode.OP_GET_CAPTURED] = op_get_upvalue
+DISPATCH[sp.ContextOpcode.OP_SET_UPVALUE] = op_set_upvalue
+DISPATCH[sp.ContextOpcode.OP_RETURN] = op_return
+DISPATCH[sp.ContextOpcode.OP_NIL] = op_nil
+DISPATCH[sp.ContextOpcode.OP_TRUE] = op_true
+DISPATCH[sp.ContextOpcode.OP_FALSE] = op_false
+DISPATCH[sp.ContextOpcode.OP_GET_GLOBAL] = op_get_global
+DISPATCH[sp.ContextOpcode.OP_DEFINE_GLOBAL] = op_define_global
+DISPATCH[sp.ContextOpcode.OP_SET_GLOBAL] = op_set_global
+DISPATCH[sp.ContextOpcode.OP_GET_PROPERTY] = op_get_property
+DISPATCH[sp.ContextOpcode.OP_SET_PROPERTY] = op_set_property
+DISPATCH[sp.ContextOpcode.OP_GET_LOCAL] = op_get_local
+DISPATCH[sp.ContextOpcode.OP_SET_LOCAL] = op_set_local
+DISPATCH[sp.ContextOpcode.OP_SUBTRACT] = binary_op_handler(operator.sub, float)
+DISPATCH[sp.ContextOpcode.OP_MULTIPLY] = binary_op_handler(operator.mul, float)
+DISPATCH[sp.ContextOpcode.OP_DIVIDE] = binary_op_handler(operator.truediv, float)
+DISPATCH[sp.ContextOpcode.OP_GREATER] = binary_op_handler(operator.gt, bool)
+DISPATCH[sp.ContextOpcode.OP_LESS] = binary_op_handler(operator.lt, bool)
+DISPATCH[sp.ContextOpcode.OP_NOT] = op_not
+DISPATCH[sp.ContextOpcode.OP_NEGATE] = op_negate
+DISPATCH[sp.ContextOpcode.OP_POP] = op_pop
+DISPATCH[sp.ContextOpcode.OP_POP_SCOPED] = op_pop
+DISPATCH[sp.ContextOpcode.OP_EQUAL] = op_equal
+DISPATCH[sp.ContextOpcode.OP_ADD] = op_add
+DISPATCH[sp.ContextOpcode.OP_LOOP] = op_jump
+DISPATCH[sp.ContextOpcode.OP_JUMP] = op_jump
+DISPATCH[sp.ContextOpcode.OP_JUMP_IF_FALSE] = op_jump_if_false
+DISPATCH[sp.ContextOpcode.OP_CALL] = op_call
+DISPATCH[sp.ContextOpcode.OP_CALL_SCOPED] = op_call
+DISPATCH[sp.ContextOpcode.OP_CLASS] = op_class
+DISPATCH[sp.ContextOpcode.OP_METHOD] = op_method
+DISPATCH[sp.ContextOpcode.OP_INVOKE] = op_invoke
+DISPATCH[sp.ContextOpcode.OP_INHERIT] = op_inherit
+DISPATCH[sp.ContextOpcode.OP_GET_SUPER] = op_get_super
+DISPATCH[sp.ContextOpcode.OP_SUPER_INVOKE] = op_super_invoke
+
 def run(vm_runtime_read_only_main: VMRuntimeReadOnlyData, vm_runtime_write_only_main: VMRuntimeWriteOnlyData, data_stack: typing.List):
     vmRuntimeCallstack = vm_runtime_write_only_main.callstack
+    dispatch = DISPATCH
 
     while True:
-        instruction_value, vmRuntimeCallstack[-1].ip = read_byte(vm_runtime_read_only_main, vmRuntimeCallstack[-1])
-        # print("Executing instruction value: " + str(instruction_value) + " and: " + str(sp.ContextOpcode(instruction_value)))
-        if instruction_value == sp.ContextOpcode.OP_CONSTANT:
-            constant, vmRuntimeCallstack[-1].ip = read_constant(vm_runtime_read_only_main, vmRuntimeCallstack[-1])
-            data_stack.append(constant)
-        elif instruction_value == sp.ContextOpcode.OP_PRINT:
-            print(data_stack.pop())
-        elif instruction_value == sp.ContextOpcode.OP_CLOSURE:
-            temp_context, vmRuntimeCallstack[-1].ip = read_constant(vm_runtime_read_only_main, vmRuntimeCallstack[-1])
-            closure = new_closure(temp_context)
-            data_stack.append(closure)
-            for i in range(temp_context.upvalue_count): #TODO: Potential for a bug to live here
-                is_local, vmRuntimeCallstack[-1].ip  = read_byte(vm_runtime_read_only_main, vmRuntimeCallstack[-1])
-                index, vmRuntimeCallstack[-1].ip  = read_byte(vm_runtime_read_only_main, vmRuntimeCallstack[-1])
-                if (is_local > 0):
-                    closure.upvalues.append(data_stack[vmRuntimeCallstack[-1].slot_offset + index])
-                else:
-                    closure.upvalues.append(vmRuntimeCallstack[-1].upvalues[index])
-                    
-        elif instruction_value == sp.ContextOpcode.OP_GET_UPVALUE:
-            slot, vmRuntimeCallstack[-1].ip = read_byte(vm_runtime_read_only_main, vmRuntimeCallstack[-1])
-            data_stack.append(vmRuntimeCallstack[-1].upvalues[slot])
-
-        elif instruction_value == sp.ContextOpcode.OP_SET_UPVALUE:
-            slot, vmRuntimeCallstack[-1].ip = read_byte(vm_runtime_read_only_main, vmRuntimeCallstack[-1])
-            vmRuntimeCallstack[-1].upvalues[slot] = data_stack[-1] #TODO: Fix
-            
-
-        elif instruction_value == sp.ContextOpcode.OP_SET_UPVALUE:
-            slot, vmRuntimeCallstack[-1].ip = read_byte(vm_runtime_read_only_main, vmRuntimeCallstack[-1])
-
-        elif instruction_value == sp.ContextOpcode.OP_RETURN:
-            result = data_stack.pop()
-            truncated_end_value = vmRuntimeCallstack[-1].slot_offset
-            vmRuntimeCallstack.pop()
-            if len(vmRuntimeCallstack) == 0:
-                data_stack.pop()
-                return True
-            data_stack = data_stack[:truncated_end_value]
-            data_stack.append(result)
-        
-        elif instruction_value == sp.ContextOpcode.OP_NIL:
-            data_stack.append(None)
-        elif instruction_value == sp.ContextOpcode.OP_TRUE:
-            data_stack.append(True)
-        elif instruction_value == sp.ContextOpcode.OP_FALSE:
-            data_stack.append(False)   
-        elif instruction_value == sp.ContextOpcode.OP_GET_GLOBAL:
-            name, vmRuntimeCallstack[-1].ip = read_constant(vm_runtime_read_only_main, vmRuntimeCallstack[-1])
-            if (name not in vm_runtime_write_only_main.global_data):
-                runtimeError(f'Undefined variable \'{name}\'.', vm_runtime_read_only_main, vmRuntimeCallstack)
-                return False
-            data_stack.append(vm_runtime_write_only_main.global_data[name])
-        elif instruction_value == sp.ContextOpcode.OP_DEFINE_GLOBAL:
-            name, vmRuntimeCallstack[-1].ip = read_constant(vm_runtime_read_only_main, vmRuntimeCallstack[-1])
-            vm_runtime_write_only_main.global_data[name] = data_stack[-1]
-            data_stack.pop()
-        elif instruction_value == sp.ContextOpcode.OP_SET_GLOBAL:
-            name, vmRuntimeCallstack[-1].ip = read_constant(vm_runtime_read_only_main, vmRuntimeCallstack[-1])
-            if (name not in vm_runtime_write_only_main.global_data):
-                runtimeError(f'Undefined variable \'{name}\'.', vm_runtime_read_only_main, vmRuntimeCallstack)
-                return False
-            else:
-                value = data_stack[-1]
-                vm_runtime_write_only_main.global_data[name] = value
-        elif instruction_value == sp.ContextOpcode.OP_GET_PROPERTY:
-            instance = data_stack[-1]
-
-            if not isinstance(instance, LoxInstance):
-                runtimeError("Only instances have properties.")
-                return False
-
-            name, vmRuntimeCallstack[-1].ip = read_constant(vm_runtime_read_only_main, vmRuntimeCallstack[-1])
-
-            if (name in instance.fields):
-                value = instance.fields[name]
-                data_stack.pop()
-                data_stack.append(value)
-            else:
-                if (not bind_method(instance.klass, name, data_stack)):
-                    return False
-
-        
-        elif instruction_value == sp.ContextOpcode.OP_SET_PROPERTY:
-            instance = data_stack[-2]
-            name, vmRuntimeCallstack[-1].ip = read_constant(vm_runtime_read_only_main, vmRuntimeCallstack[-1])
-            instance.fields[name] = data_stack[-1]
-            value = data_stack.pop()
-            data_stack.pop()
-            data_stack.append(value)
-
-        elif instruction_value == sp.ContextOpcode.OP_GET_LOCAL: 
-            slot, vmRuntimeCallstack[-1].ip = read_byte(vm_runtime_read_only_main, vmRuntimeCallstack[-1])
-            data_stack.append(data_stack[vmRuntimeCallstack[-1].slot_offset + slot])
-        elif instruction_value == sp.ContextOpcode.OP_SET_LOCAL: 
-            slot, vmRuntimeCallstack[-1].ip = read_byte(vm_runtime_read_only_main, vmRuntimeCallstack[-1])
-            data_stack[vmRuntimeCallstack[-1].slot_offset + slot] = data_stack[-1]
-        elif instruction_value == sp.ContextOpcode.OP_SUBTRACT:
-            if (binaryOp(vm_runtime_read_only_main, vmRuntimeCallstack, data_stack, operator.sub, float) == False):
-                return False
-        elif instruction_value == sp.ContextOpcode.OP_MULTIPLY:
-            if (binaryOp(vm_runtime_read_only_main, vmRuntimeCallstack, data_stack, operator.mul, float) == False):
-                return False
-        elif instruction_value == sp.ContextOpcode.OP_DIVIDE:
-            if (binaryOp(vm_runtime_read_only_main, vmRuntimeCallstack, data_stack, operator.truediv, float) == False):
-                return False
-        elif instruction_value == sp.ContextOpcode.OP_NOT:
-            data_stack.append(is_falsey(data_stack.pop()))
-        elif instruction_value == sp.ContextOpcode.OP_NEGATE:
-            if type(data_stack[-1]) != float:
-                runtimeError("Operand must be a number.", vm_runtime_read_only_main, vmRuntimeCallstack)
-                return False
-            data_stack.append(-(data_stack.pop()))
-        elif instruction_value == sp.ContextOpcode.OP_POP:
-            data_stack.pop()
-        elif instruction_value == sp.ContextOpcode.OP_EQUAL:
-            b = data_stack.pop()
-            a = data_stack.pop()
-            data_stack.append(a == b)
-        elif instruction_value == sp.ContextOpcode.OP_GREATER:
-            if binaryOp(vm_runtime_read_only_main, vmRuntimeCallstack, data_stack, operator.gt, bool) == False:
-                return False
-
-        elif instruction_value == sp.ContextOpcode.OP_LESS:
-            if binaryOp(vm_runtime_read_only_main, vmRuntimeCallstack, data_stack, operator.lt, bool) == False:
-                return False
-
-        elif instruction_value == sp.ContextOpcode.OP_ADD:
-            # breakpoint()
-            if type(data_stack[-1]) == str and type(data_stack[-2]) == str:
-                # breakpoint()
-                val_2 = data_stack.pop()
-                val_1 = data_stack.pop()
-                data_stack.append(concatenate(val_1, val_2))
-            elif type(data_stack[-1]) == float and type(data_stack[-2]) == float:
-                data_stack.append(data_stack.pop() + data_stack.pop())
-            else:
-                runtimeError("Operands must be two numbers or two strings.", vm_runtime_read_only_main, vmRuntimeCallstack)
-                return False    
-        elif instruction_value == sp.ContextOpcode.OP_LOOP:
-            offset, vmRuntimeCallstack[-1].ip = read_short(vm_runtime_read_only_main, vmRuntimeCallstack[-1])
-            vmRuntimeCallstack[-1].ip -= offset
-        elif instruction_value == sp.ContextOpcode.OP_JUMP:
-            offset, vmRuntimeCallstack[-1].ip = read_short(vm_runtime_read_only_main, vmRuntimeCallstack[-1])
-            vmRuntimeCallstack[-1].ip += offset
-        elif instruction_value == sp.ContextOpcode.OP_JUMP_IF_FALSE:
-            offset, vmRuntimeCallstack[-1].ip = read_short(vm_runtime_read_only_main, vmRuntimeCallstack[-1])
-            if is_falsey(data_stack[-1]):
-                vmRuntimeCallstack[-1].ip += offset
-        elif instruction_value == sp.ContextOpcode.OP_CALL:
-            arg_count, vmRuntimeCallstack[-1].ip = read_byte(vm_runtime_read_only_main, vmRuntimeCallstack[-1])
-            if (not call_value(vm_runtime_read_only_main, vmRuntimeCallstack, data_stack, 
-                    data_stack[-(arg_count + 1)], arg_count)):
-                return False
-        elif instruction_value == sp.ContextOpcode.OP_CLASS:
-            class_name, vmRuntimeCallstack[-1].ip = read_constant(vm_runtime_read_only_main, vmRuntimeCallstack[-1])
-            data_stack.append(LoxClass(class_name, {}))
-        elif instruction_value == sp.ContextOpcode.OP_METHOD:
-            name, vmRuntimeCallstack[-1].ip = read_constant(vm_runtime_read_only_main, vmRuntimeCallstack[-1])
-            define_method(name, data_stack)
-        elif instruction_value == sp.ContextOpcode.OP_INVOKE:
-            method, vmRuntimeCallstack[-1].ip = read_constant(vm_runtime_read_only_main, vmRuntimeCallstack[-1])
-            arg_count, vmRuntimeCallstack[-1].ip = read_byte(vm_runtime_read_only_main, vmRuntimeCallstack[-1])
-            if not invoke(vm_runtime_read_only_main, method, arg_count, vmRuntimeCallstack, data_stack):
-                return False
-        elif instruction_value == sp.ContextOpcode.OP_INHERIT:
-            superclass = data_stack[-2]
-            subclass = data_stack[-1]
-            for method in superclass.methods.items():
-                subclass.methods[method[0]] = method[1]
-            data_stack.pop()
-        elif instruction_value == sp.ContextOpcode.OP_GET_SUPER:
-            name, vmRuntimeCallstack[-1].ip = read_constant(vm_runtime_read_only_main, vmRuntimeCallstack[-1])
-            superclass = data_stack.pop()
-
-            if (not bind_method(superclass, name, data_stack)):
-                return False
-
-        elif instruction_value == sp.ContextOpcode.OP_SUPER_INVOKE:
-            method, vmRuntimeCallstack[-1].ip = read_constant(vm_runtime_read_only_main, vmRuntimeCallstack[-1])
-            arg_count, vmRuntimeCallstack[-1].ip = read_byte(vm_runtime_read_only_main, vmRuntimeCallstack[-1])
-            superclass = data_stack.pop()
-      
-            if not invoke_from_klass(vm_runtime_read_only_main, superclass, method, arg_count, vmRuntimeCallstack, data_stack):
-                return False
+        frame = vmRuntimeCallstack[-1]
+        instruction_value, frame.ip, operand, extra = frame.function.instructions[frame.ip]
+        result = dispatch[instruction_value](vm_runtime_read_only_main, vm_runtime_write_only_main, frame, data_stack, operand, extra)
+        if result is not None:
+            return result
 
 def invoke_from_klass(vm_runtime_read_only_main: VMRuntimeReadOnlyData, klass: LoxClass, name: str, arg_count: int, call_stack: typing.List[CallStackSingleElement],
             data_stack: typing.List) -> bool:
@@ -328,12 +305,7 @@ def call_value(vm_runtime_read_only_main: VMRuntimeReadOnlyData, call_stack: typ
         data_stack.append(result)
         return True
     elif isinstance(callee, RuntimeClosure):
-        new_function_address = callee.function_ptr
-        if (new_function_address not in vm_runtime_read_only_main.contextmap):
-            print("Can only call functions and classes")
-        else:
-            #Todo: Fix
-            return call(vm_runtime_read_only_main, callee, arg_count, call_stack, data_stack)
+        return call(vm_runtime_read_only_main, callee, arg_count, call_stack, data_stack)
     else:
         runtimeError("Invalid type", vm_runtime_read_only_main, call_stack)
 
@@ -350,7 +322,7 @@ def bind_method(klass: LoxClass, name: str, data_stack: typing.List) -> bool:
         return True
 
 def call(vm_runtime_read_only_main: VMRuntimeReadOnlyData, closure: RuntimeClosure, arg_count: int, call_stack: typing.List[CallStackSingleElement], data_stack: typing.List) -> bool:
-    context = vm_runtime_read_only_main.contextmap[closure.function_ptr]
+    context = closure.function
     if (arg_count != context.arity):
         # runtimeError(5, call_stack)
         runtimeError(f'Expected {context.arity} arguments but got {arg_count}', vm_runtime_read_only_main, call_stack)
@@ -359,15 +331,15 @@ def call(vm_runtime_read_only_main: VMRuntimeReadOnlyData, closure: RuntimeClosu
         # print("Stack overflow")
         runtimeError("Stack overflow", vm_runtime_read_only_main, call_stack)
         return False
-    call_stack.append(CallStackSingleElement(context.function_address, context.first_instruction_address, len(data_stack) -(arg_count + 1), closure.upvalues))
+    call_stack.append(CallStackSingleElement(context, 0, len(data_stack) -(arg_count + 1), closure.upvalues))
     return True
 
 def main():
     if len(sys.argv) > 2 or len(sys.argv) < 2:
         print("Usage: plox [script]")
     elif len(sys.argv) == 2:
-        (vm_runtime_read_only_main, vm_runtime_write_only_main, data_stack, initial_context_ptr) = generate_vm_data(sys.argv[1])
-        closure = new_closure(vm_runtime_read_only_main.contextmap[initial_context_ptr])
+        (vm_runtime_read_only_main, vm_runtime_write_only_main, data_stack, script) = generate_vm_data(sys.argv[1])
+        closure = new_closure(script)
         data_stack.pop()
         data_stack.append(closure)
         call(vm_runtime_read_only_main, closure, 0, vm_runtime_write_only_main.callstack, data_stack)
@@ -1,19 +1,31 @@
-from dataclasses import dataclass
+from dataclasses import dataclass, field
 from lib import serializationPackage as sp
+import betterproto
 import typing
 import time
 
 
+@dataclass
+class ReplayFunction:
+    """A function decoded once at load. instructions holds, at the offset of
+    each instruction, a tuple (opcode, next offset, operand, extra); offsets
+    inside an instruction's operands hold None. Constant operands are already
+    the constant's value and jump operands the offset they jump to. extra is
+    the argument count of invokes and the (is_local, index) pairs of a
+    closure's upvalues."""
+    name: str
+    arity: int
+    upvalue_count: int
+    instructions: typing.List[typing.Optional[tuple]] = field(default_factory=list, repr=False)
+
 @dataclass
 class VMRuntimeReadOnlyData:
-    """Class for keeping track of an item in inventory."""
-    stringmap: typing.Dict[int, str]
-    contextmap: typing.Dict[int, sp.Context]
-    initial_context_ptr: int
+    functions: typing.List[ReplayFunction]
+    script: ReplayFunction
 
 @dataclass
 class CallStackSingleElement:
-    funcPointer: int
+    function: ReplayFunction
     ip: int
     slot_offset: int
     upvalues: typing.List[sp.Upvalue]
@@ -25,7 +37,7 @@ class VMRuntimeWriteOnlyData:
 
 @dataclass
 class RuntimeClosure:
-    function_ptr: int
+    function: ReplayFunction
     upvalues: typing.List[sp.Upvalue]
 
 @dataclass 
@@ -43,25 +55,34 @@ class RuntimeBoundMethod:
     lox_instance: LoxInstance
     closure: RuntimeClosure
 
-def load_vmdata(path: str) -> sp.VMData():
-    vmdata = sp.VMData()
+# A version 2 file starts with its version field (field 1, varint) and a
+# version 1 file with its first context (field 1, length delimited).
+VMDATA_V2_FIRST_BYTE = 0x08
+
+def load_vmdata(path: str) -> typing.Union[sp.VMData, sp.VMDataV2]:
     f = open(path, "rb")
-    vmdata.parse(f.read())
+    data = f.read()
     f.close()
+    if data[:1] == bytes([VMDATA_V2_FIRST_BYTE]):
+        return sp.VMDataV2().parse(data)
+    vmdata = sp.VMData()
+    vmdata.parse(data)
     return vmdata
 
 def generate_vm_data(path: str):
     vmdata = load_vmdata(path)
 
-    runtime_string_map = build_string_map(vmdata.strings_at_addresses)
-    runtime_instruction_context_map, initial_context_ptr = build_instruction_map_and_initial_context(vmdata.contexts)
-    vm_runtime_read_only_main = VMRuntimeReadOnlyData(runtime_string_map, runtime_instruction_context_map, initial_context_ptr)
+    if isinstance(vmdata, sp.VMDataV2):
+        functions, script = decode_v2(vmdata)
+    else:
+        functions, script = decode_v1(vmdata)
+    vm_runtime_read_only_main = VMRuntimeReadOnlyData(functions, script)
     vmRuntimeCallstack = []
-    data_stack = [vm_runtime_read_only_main.contextmap[initial_context_ptr]]
+    data_stack = [script]
     vm_runtime_write_only_main = VMRuntimeWriteOnlyData(vmRuntimeCallstack, {})
     define_native("clock", clock_native, data_stack, vm_runtime_write_only_main.global_data)
     
-    return vm_runtime_read_only_main, vm_runtime_write_only_main, data_stack, initial_context_ptr
+    return vm_runtime_read_only_main, vm_runtime_write_only_main, data_stack, script
 
 def clock_native(arg_count: int, args):
     return time.process_time()
@@ -73,25 +94,98 @@ def define_native(name: str, function_body, data_stack: typing.List, global_data
     data_stack.pop()
     data_stack.pop()
 
-def build_string_map(string_data):
-    string_map = {}
-    for string_datum in string_data:
-        string_map[string_data[string_datum].address] = string_datum
-    
-    return string_map
-
-def build_instruction_map_and_initial_context(contexts: typing.List[sp.Context]):
-    context_map = {}
-    initial_context_ptr = -1
-    for context in contexts:
-        context_ptr = context.function_address
-        #sort dict here:
-        context.instruction_vals = dict(sorted(context.instruction_vals.items(), key=lambda item: item[0]))
-        context_map[context_ptr] = context
+# Operand bytes of each opcode, as operandBytes() in chunk.cpp counts them.
+# Version 2 files carry their own table.
+V1_OPERAND_BYTES = [0] * (sp.ContextOpcode.OP_POP_SCOPED + 1)
+for opcode in (sp.ContextOpcode.OP_CONSTANT, sp.ContextOpcode.OP_GET_LOCAL, sp.ContextOpcode.OP_SET_LOCAL,
+        sp.ContextOpcode.OP_GET_GLOBAL, sp.ContextOpcode.OP_DEFINE_GLOBAL, sp.ContextOpcode.OP_SET_GLOBAL,
+        sp.ContextOpcode.OP_GET_UPVALUE, sp.ContextOpcode.OP_SET_UPVALUE, sp.ContextOpcode.OP_GET_PROPERTY,
+        sp.ContextOpcode.OP_SET_PROPERTY, sp.ContextOpcode.OP_CALL, sp.ContextOpcode.OP_CLOSURE,
+        sp.ContextOpcode.OP_CLASS, sp.ContextOpcode.OP_GET_SUPER, sp.ContextOpcode.OP_METHOD,
+        sp.ContextOpcode.OP_GET_CAPTURED, sp.ContextOpcode.OP_CALL_SCOPED):
+    V1_OPERAND_BYTES[opcode] = 1
+for opcode in (sp.ContextOpcode.OP_JUMP, sp.ContextOpcode.OP_JUMP_IF_FALSE, sp.ContextOpcode.OP_LOOP,
+        sp.ContextOpcode.OP_INVOKE, sp.ContextOpcode.OP_SUPER_INVOKE):
+    V1_OPERAND_BYTES[opcode] = 2
+
+CONSTANT_OPCODES = {sp.ContextOpcode.OP_CONSTANT, sp.ContextOpcode.OP_GET_GLOBAL, sp.ContextOpcode.OP_DEFINE_GLOBAL,
+    sp.ContextOpcode.OP_SET_GLOBAL, sp.ContextOpcode.OP_GET_PROPERTY, sp.ContextOpcode.OP_SET_PROPERTY,
+    sp.ContextOpcode.OP_CLOSURE, sp.ContextOpcode.OP_CLASS, sp.ContextOpcode.OP_GET_SUPER,
+    sp.ContextOpcode.OP_METHOD, sp.ContextOpcode.OP_INVOKE, sp.ContextOpcode.OP_SUPER_INVOKE}
+
+def decode_instructions(code: typing.List[int], constants: typing.List, operand_bytes: typing.List[int]):
+    instructions = [None] * len(code)
+    offset = 0
+    while offset < len(code):
+        opcode = code[offset]
+        # Bytes past the table, like the placeholder after a jump, have no operands.
+        next_offset = offset + 1 + (operand_bytes[opcode] if opcode < len(operand_bytes) else 0)
+        operand = code[offset + 1] if next_offset > offset + 1 else None
+        extra = None
+        if opcode in CONSTANT_OPCODES:
+            operand = constants[operand]
+            if opcode == sp.ContextOpcode.OP_INVOKE or opcode == sp.ContextOpcode.OP_SUPER_INVOKE:
+                extra = code[offset + 2]
+        elif opcode == sp.ContextOpcode.OP_JUMP or opcode == sp.ContextOpcode.OP_JUMP_IF_FALSE:
+            operand = next_offset + (code[offset + 1] << 8 | code[offset + 2])
+        elif opcode == sp.ContextOpcode.OP_LOOP:
+            operand = next_offset - (code[offset + 1] << 8 | code[offset + 2])
+        if opcode == sp.ContextOpcode.OP_CLOSURE:
+            extra = [(code[next_offset + 2 * i], code[next_offset + 2 * i + 1]) for i in range(operand.upvalue_count)]
+            next_offset += 2 * operand.upvalue_count
+        instructions[offset] = (opcode, next_offset, operand, extra)
+        offset = next_offset
+    return instructions
+
+def constant_from_v2(constant: sp.ConstantV2, strings: typing.List[str], functions: typing.List[ReplayFunction]):
+    field_name, value = betterproto.which_one_of(constant, "value")
+    if field_name == "string_index":
+        return strings[value]
+    elif field_name == "function_index":
+        return functions[value]
+    elif field_name == "":
+        return None
+    return value
+
+def decode_v2(vmdata: sp.VMDataV2):
+    functions = [ReplayFunction(vmdata.strings[function.name] if function.name >= 0 else "",
+            function.arity, function.upvalue_count) for function in vmdata.functions]
+    for function, saved in zip(functions, vmdata.functions):
+        constants = [constant_from_v2(constant, vmdata.strings, functions) for constant in saved.constants]
+        function.instructions = decode_instructions(list(saved.code), constants, vmdata.operand_bytes)
+    return functions, functions[vmdata.script]
+
+def constant_from_v1(constant: sp.ValueType, objects: typing.Dict[int, typing.Any]):
+    field_name, value = betterproto.which_one_of(constant, "ValueTypes")
+    if field_name == "string_address" or field_name == "function_address":
+        return objects[value]
+    elif field_name == "":
+        return None
+    return value
+
+def decode_v1(vmdata: sp.VMData):
+    """Version 1 refers to strings and functions by the addresses they had in
+    the VM that wrote it, and keys each byte of code by its own address."""
+    objects = {}
+    for string, address_and_hash in vmdata.strings_at_addresses.items():
+        objects[address_and_hash.address] = string
+    functions = []
+    script = None
+    for context in vmdata.contexts:
+        function = ReplayFunction(context.context_name, context.arity, context.upvalue_count)
+        objects[context.function_address] = function
+        functions.append(function)
         if context.context_name == "":
-            initial_context_ptr = context_ptr
-    return context_map, initial_context_ptr
-
-def new_closure(context: sp.Context):
-    num_of_upvalues = context.upvalue_count
-    return RuntimeClosure(context.function_address, [])
\ No newline at end of file
+            script = function
+    for function, context in zip(functions, vmdata.contexts):
+        code = []
+        for address in sorted(context.instruction_vals):
+            instruction = context.instruction_vals[address]
+            field_name, value = betterproto.which_one_of(instruction, "InstructionTypes")
+            code.append(int(value))
+        constants = [constant_from_v1(context.constant_vals[index], objects) for index in range(len(context.constant_vals))]
+        function.instructions = decode_instructions(code, constants, V1_OPERAND_BYTES)
+    return functions, script
+
+def new_closure(function: ReplayFunction):
+    return RuntimeClosure(function, [])
\ No newline at end of file
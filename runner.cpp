@@ -0,0 +1,55 @@
+// Runs a VMData file written with --export-vmdata, without the scanner or
+// compiler.
+#include "common.h"
+#include <iostream>
+#include <string.h>
+#include "loader.h"
+#include "vm.h"
+
+static void usage() {
+    std::cerr << "Usage: lox_run [--arena] [--arena-limit=<MB>] [--arena-fallback=gc|fail] path" << std::endl;
+    exit(64);
+}
+
+int main(int argc, const char *argv[])
+{
+    const char* path = NULL;
+    bool arena = false;
+    size_t arenaLimit = 256 * 1024 * 1024;
+    ArenaFallback arenaFallback = ARENA_FALLBACK_GC;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--arena") == 0) {
+            arena = true;
+        } else if (strncmp(argv[i], "--arena-limit=", 14) == 0) {
+            arena = true;
+            arenaLimit = (size_t) strtoull(argv[i] + 14, NULL, 10) * 1024 * 1024;
+        } else if (strcmp(argv[i], "--arena-fallback=gc") == 0) {
+            arenaFallback = ARENA_FALLBACK_GC;
+        } else if (strcmp(argv[i], "--arena-fallback=fail") == 0) {
+            arenaFallback = ARENA_FALLBACK_FAIL;
+        } else if (argv[i][0] == '-' || path != NULL) {
+            usage();
+        } else {
+            path = argv[i];
+        }
+    }
+    if (path == NULL) {
+        usage();
+    }
+
+    if (arena) {
+        enableArenaMode(arenaLimit, arenaFallback);
+    }
+    initVM();
+    ObjFunction* script = loadVMData(path);
+    if (script == NULL) {
+        exit(65);
+    }
+    if (runScript(script) == INTERPRET_RUNTIME_ERROR) {
+        exit(70);
+    }
+
+    freeVM();
+    return 0;
+}
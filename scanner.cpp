@@ -1,5 +1,8 @@
 #include <stdio.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "common.h"
 #include "scanner.h"
@@ -18,6 +21,11 @@ void initScanner(const char* source){
     scanner.line = 1;
 }
 
+void resumeScanner(const char* from, int line) {
+    initScanner(from);
+    scanner.line = line;
+}
+
 static bool isDigit(char c){
     return c >= '0' && c <= '9';
 }
@@ -76,30 +84,181 @@ static char peekNext(){
     return scanner.current[1];
 }
 
+// The runs of blanks, comments, identifiers and strings are scanned 16 bytes
+// at a time. A block may read past the terminating NUL, so it is only loaded
+// when it can't cross into the next page, which might not be mapped; the last
+// few bytes of each page go through the byte at a time loops instead. Most
+// blank runs are a single space and most names are short, so those are tried
+// a byte at a time before loading a block.
+const uintptr_t SCAN_PAGE_SIZE = 4096;
+const int SCAN_BLOCK_SIZE = 16;
+const int SCAN_SHORT_NAME = 4;
+
+static bool isBlank(char c) {
+    return c == ' ' || c == '\r' || c == '\t' || c == '\n';
+}
+
+static bool isIdentifierChar(char c) {
+    return isAlpha(c) || isDigit(c);
+}
+
+#ifdef __SSE2__
+
+static bool canLoadBlock(const char* p) {
+    return ((uintptr_t) p & (SCAN_PAGE_SIZE - 1)) <= SCAN_PAGE_SIZE - SCAN_BLOCK_SIZE;
+}
+
+static __m128i loadBlock(const char* p) {
+    return _mm_loadu_si128((const __m128i*) p);
+}
+
+// Bit i is set when byte i of the block is c.
+static uint32_t matchChar(__m128i block, char c) {
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8(c)));
+}
+
+static uint32_t matchRange(__m128i block, char low, char high) {
+    __m128i above = _mm_cmpgt_epi8(block, _mm_set1_epi8((char) (low - 1)));
+    __m128i below = _mm_cmplt_epi8(block, _mm_set1_epi8((char) (high + 1)));
+    return _mm_movemask_epi8(_mm_and_si128(above, below));
+}
+
+static uint32_t matchIdentifierChars(__m128i block) {
+    // Setting bit 5 folds upper case onto lower case without letting any
+    // other byte into a-z.
+    __m128i folded = _mm_or_si128(block, _mm_set1_epi8(0x20));
+    return matchRange(folded, 'a', 'z') | matchRange(block, '0', '9') | matchChar(block, '_');
+}
+
+static int countBelow(uint32_t mask, int index) {
+    return __builtin_popcount(mask & ((1u << index) - 1));
+}
+
+#endif
+
+// Skips spaces, tabs and newlines, counting the lines passed.
+static const char* skipBlanks(const char* p, int* lines) {
+#ifdef __SSE2__
+    if (!isBlank(*p)) {
+        return p;
+    }
+    if (!isBlank(p[1])) {
+        *lines += *p == '\n';
+        return p + 1;
+    }
+    while (isBlank(*p)) {
+        if (!canLoadBlock(p)) {
+            *lines += *p == '\n';
+            p++;
+            continue;
+        }
+        __m128i block = loadBlock(p);
+        uint32_t newlines = matchChar(block, '\n');
+        uint32_t blanks = newlines | matchChar(block, ' ') | matchChar(block, '\t') | matchChar(block, '\r');
+        if (blanks != 0xffff) {
+            int length = __builtin_ctz(~blanks);
+            *lines += countBelow(newlines, length);
+            return p + length;
+        }
+        *lines += __builtin_popcount(newlines);
+        p += SCAN_BLOCK_SIZE;
+    }
+#else
+    while (isBlank(*p)) {
+        *lines += *p == '\n';
+        p++;
+    }
+#endif
+    return p;
+}
+
+// Returns the newline or NUL ending the line p is on.
+static const char* findLineEnd(const char* p) {
+#ifdef __SSE2__
+    while (*p != '\n' && *p != '\0') {
+        if (!canLoadBlock(p)) {
+            p++;
+            continue;
+        }
+        __m128i block = loadBlock(p);
+        uint32_t ends = matchChar(block, '\n') | matchChar(block, '\0');
+        if (ends != 0) {
+            return p + __builtin_ctz(ends);
+        }
+        p += SCAN_BLOCK_SIZE;
+    }
+#else
+    while (*p != '\n' && *p != '\0') {
+        p++;
+    }
+#endif
+    return p;
+}
+
+static const char* skipIdentifierChars(const char* p) {
+#ifdef __SSE2__
+    for (int i = 0; i < SCAN_SHORT_NAME; i++) {
+        if (!isIdentifierChar(*p)) {
+            return p;
+        }
+        p++;
+    }
+    while (isIdentifierChar(*p)) {
+        if (!canLoadBlock(p)) {
+            p++;
+            continue;
+        }
+        uint32_t chars = matchIdentifierChars(loadBlock(p));
+        if (chars != 0xffff) {
+            return p + __builtin_ctz(~chars);
+        }
+        p += SCAN_BLOCK_SIZE;
+    }
+#else
+    while (isIdentifierChar(*p)) {
+        p++;
+    }
+#endif
+    return p;
+}
+
+// Returns the closing quote or the NUL ending an unterminated string,
+// counting the lines inside it.
+static const char* findStringEnd(const char* p, int* lines) {
+#ifdef __SSE2__
+    while (*p != '"' && *p != '\0') {
+        if (!canLoadBlock(p)) {
+            *lines += *p == '\n';
+            p++;
+            continue;
+        }
+        __m128i block = loadBlock(p);
+        uint32_t newlines = matchChar(block, '\n');
+        uint32_t ends = matchChar(block, '"') | matchChar(block, '\0');
+        if (ends != 0) {
+            int length = __builtin_ctz(ends);
+            *lines += countBelow(newlines, length);
+            return p + length;
+        }
+        *lines += __builtin_popcount(newlines);
+        p += SCAN_BLOCK_SIZE;
+    }
+#else
+    while (*p != '"' && *p != '\0') {
+        *lines += *p == '\n';
+        p++;
+    }
+#endif
+    return p;
+}
+
 static void skipWhitespace() {
     for (;;) {
-        char c = peek();
-        switch (c) {
-            case ' ':
-            case '\r':
-            case '\t':
-                advance();
-                break;
-            case '\n':
-                scanner.line++;
-                advance();
-                break;
-            case '/':
-                if (peekNext() == '/') {
-                    while (peek() != '\n' && !isAtEnd()){
-                        advance();
-                    }
-                } else{
-                    return;
-                }
-            default:
-                return;
+        scanner.current = skipBlanks(scanner.current, &scanner.line);
+        if (peek() != '/' || peekNext() != '/') {
+            return;
         }
+        scanner.current = findLineEnd(scanner.current + 2);
     }
 }
 
@@ -121,12 +280,7 @@ static Token number() {
 
 
 static Token string() {
-    while (peek() != '"' && !isAtEnd()){
-        if (peek() == '\n'){
-            scanner.line++;
-        }
-        advance();
-    }
+    scanner.current = findStringEnd(scanner.current, &scanner.line);
 
     if (isAtEnd()){
         return errorToken("unterminated string.");
@@ -135,54 +289,66 @@ static Token string() {
     return makeToken(TOKEN_STRING);
 }
 
+// Keywords are found with a perfect hash of their first two characters and
+// length, checked for collisions when the table is built at compile time.
+typedef struct {
+    const char* chars;
+    int length;
+    TokenType type;
+} Keyword;
+
+static constexpr Keyword keywords[] = {
+    {"and", 3, TOKEN_AND}, {"class", 5, TOKEN_CLASS}, {"else", 4, TOKEN_ELSE},
+    {"false", 5, TOKEN_FALSE}, {"for", 3, TOKEN_FOR}, {"fun", 3, TOKEN_FUN},
+    {"if", 2, TOKEN_IF}, {"nil", 3, TOKEN_NIL}, {"or", 2, TOKEN_OR},
+    {"print", 5, TOKEN_PRINT}, {"return", 6, TOKEN_RETURN}, {"super", 5, TOKEN_SUPER},
+    {"this", 4, TOKEN_THIS}, {"true", 4, TOKEN_TRUE}, {"var", 3, TOKEN_VAR},
+    {"while", 5, TOKEN_WHILE},
+};
+
+const int KEYWORD_SLOTS = 32;
+const int KEYWORD_MIN_LENGTH = 2;
+const int KEYWORD_MAX_LENGTH = 6;
 
-static TokenType checkKeyword(int start, int length, const char* rest, TokenType type){
-    if (scanner.current - scanner.start == start + length &&
-        memcmp(scanner.start + start, rest, length) == 0){
-            return type;
+static constexpr int keywordSlot(const char* chars, int length) {
+    return ((uint8_t) chars[0] * 22 + (uint8_t) chars[1] + length * 2) & (KEYWORD_SLOTS - 1);
+}
+
+typedef struct {
+    Keyword slots[KEYWORD_SLOTS];
+    bool perfect;
+} KeywordTable;
+
+static constexpr KeywordTable buildKeywordTable() {
+    KeywordTable table = {};
+    table.perfect = true;
+    for (const Keyword& keyword : keywords) {
+        Keyword& slot = table.slots[keywordSlot(keyword.chars, keyword.length)];
+        if (slot.length != 0) {
+            table.perfect = false;
         }
-    
-    return TOKEN_IDENTIFIER;
+        slot = keyword;
+    }
+    return table;
 }
 
+static constexpr KeywordTable keywordTable = buildKeywordTable();
+static_assert(keywordTable.perfect, "Keywords collide in keywordSlot().");
 
 static TokenType identifierType(){
-    switch (scanner.start[0]){
-        case 'a': return checkKeyword(1, 2, "nd", TOKEN_AND);
-        case 'c': return checkKeyword(1, 4, "lass", TOKEN_CLASS);
-        case 'e': return checkKeyword(1, 3, "lse", TOKEN_ELSE);
-        case 'f': 
-            if (scanner.current - scanner.start > 1) {
-                switch (scanner.start[1]) {
-                    case 'a': return checkKeyword(2, 3, "lse", TOKEN_FALSE);
-                    case 'o': return checkKeyword(2, 1, "r", TOKEN_FOR);
-                    case 'u': return checkKeyword(2, 1, "n", TOKEN_FUN);
-                }
-            }
-        case 'i': return checkKeyword(1, 1, "f", TOKEN_IF);
-        case 'n': return checkKeyword(1, 2, "il", TOKEN_NIL);
-        case 'o': return checkKeyword(1, 1, "r", TOKEN_OR);
-        case 'p': return checkKeyword(1, 4, "rint", TOKEN_PRINT);
-        case 'r': return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-        case 's': return checkKeyword(1, 4, "uper", TOKEN_SUPER);
-        case 't': 
-            if (scanner.current - scanner.start > 1) {
-                switch (scanner.start[1]) {
-                    case 'h': return checkKeyword(2, 2, "is", TOKEN_THIS);
-                    case 'r': return checkKeyword(2, 2, "ue", TOKEN_TRUE);
-                }
-            }
-        case 'v': return checkKeyword(1, 2, "ar", TOKEN_VAR);
-        case 'w': return checkKeyword(1, 4, "hile", TOKEN_WHILE);
-
+    int length = (int) (scanner.current - scanner.start);
+    if (length < KEYWORD_MIN_LENGTH || length > KEYWORD_MAX_LENGTH) {
+        return TOKEN_IDENTIFIER;
+    }
+    const Keyword& keyword = keywordTable.slots[keywordSlot(scanner.start, length)];
+    if (keyword.length == length && memcmp(scanner.start, keyword.chars, length) == 0) {
+        return keyword.type;
     }
     return TOKEN_IDENTIFIER;
 }
 
 static Token identifier() {
-    while (isAlpha(peek()) || isDigit(peek())){
-        advance();
-    }
+    scanner.current = skipIdentifierChars(scanner.current);
     return makeToken(identifierType());
 }
 
@@ -220,4 +386,100 @@ Token scanToken() {
         case '"': return string();
     }
     return errorToken("Unexpected character.");
-}
\ No newline at end of file
+}
+
+// Calls found with every plain name assigned to between from and the brace
+// that closes the block from is in, or the end of the source. Property
+// assignments like a.name = ... and initializers like var name = ... don't
+// count. Leaves the scanner where the compiler had it.
+void scanAssignments(const char* from, TokenVisitor found, void* context) {
+    Scanner saved = scanner;
+    initScanner(from);
+    int depth = 0;
+    TokenType previous = TOKEN_EOF;
+    Token token = scanToken();
+    while (token.type != TOKEN_EOF) {
+        Token next = scanToken();
+        if (token.type == TOKEN_LEFT_BRACE) {
+            depth++;
+        } else if (token.type == TOKEN_RIGHT_BRACE) {
+            if (depth-- == 0) {
+                break;
+            }
+        } else if (token.type == TOKEN_IDENTIFIER && next.type == TOKEN_EQUAL
+                && previous != TOKEN_DOT && previous != TOKEN_VAR) {
+            found(&token, context);
+        }
+        previous = token.type;
+        token = next;
+    }
+    scanner = saved;
+}
+
+// If the source at from is a call of a plain name ending the statement, like
+// "Point(1, 2);", returns where the statement ends. Otherwise returns NULL.
+const char* scanCallStatement(const char* from) {
+    Scanner saved = scanner;
+    initScanner(from);
+    const char* end = NULL;
+    if (scanToken().type == TOKEN_IDENTIFIER && scanToken().type == TOKEN_LEFT_PAREN) {
+        int depth = 1;
+        Token token = scanToken();
+        while (token.type != TOKEN_EOF && token.type != TOKEN_ERROR) {
+            if (token.type == TOKEN_LEFT_PAREN) {
+                depth++;
+            } else if (token.type == TOKEN_RIGHT_PAREN && --depth == 0) {
+                break;
+            }
+            token = scanToken();
+        }
+        if (depth == 0 && scanToken().type == TOKEN_SEMICOLON) {
+            end = scanner.current;
+        }
+    }
+    scanner = saved;
+    return end;
+}
+
+// Scans from from to the end of the enclosing block and reports whether the
+// object named by a type token (this) or identifier could get away: whether
+// it is used other than to read or write one of its fields. Method calls on
+// it, functions and classes declared in the block, and super (which passes
+// this along) all count as escapes.
+bool scanForEscape(const char* from, TokenType type, const char* name, int length) {
+    Scanner saved = scanner;
+    initScanner(from);
+    bool escapes = false;
+    int depth = 0;
+    TokenType previous = TOKEN_EOF;
+    Token token = scanToken();
+    while (token.type != TOKEN_EOF) {
+        if (token.type == TOKEN_LEFT_BRACE) {
+            depth++;
+        } else if (token.type == TOKEN_RIGHT_BRACE) {
+            if (depth-- == 0) {
+                break;
+            }
+        } else if (token.type == TOKEN_FUN || token.type == TOKEN_CLASS
+                || (type == TOKEN_THIS && token.type == TOKEN_SUPER)) {
+            escapes = true;
+            break;
+        } else if (token.type == type && previous != TOKEN_DOT
+                && (name == NULL || (token.length == length && memcmp(token.start, name, length) == 0))) {
+            Token dot = scanToken();
+            Token field = scanToken();
+            Token next = scanToken();
+            if (dot.type != TOKEN_DOT || field.type != TOKEN_IDENTIFIER || next.type == TOKEN_LEFT_PAREN) {
+                escapes = true;
+                break;
+            }
+            previous = field.type;
+            token = next;
+            continue;
+        }
+        previous = token.type;
+        token = scanToken();
+    }
+    scanner = saved;
+    return escapes;
+}
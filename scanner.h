@@ -28,6 +28,11 @@ typedef struct {
     int line;
 } Token;
 
+typedef void (*TokenVisitor)(Token* token, void* context);
 
 void initScanner(const char* source);
+void resumeScanner(const char* from, int line);
 Token scanToken();
+void scanAssignments(const char* from, TokenVisitor found, void* context);
+const char* scanCallStatement(const char* from);
+bool scanForEscape(const char* from, TokenType type, const char* name, int length);
@@ -0,0 +1,77 @@
+#include <stdlib.h>
+#include <string.h>
+#include "scratch.h"
+
+const size_t SCRATCH_BLOCK_SIZE = 256 * 1024;
+const size_t SCRATCH_ALIGNMENT = 16;
+
+typedef struct ScratchBlock {
+    struct ScratchBlock* next;
+    size_t size;
+    size_t used;
+    // Where the last allocation starts, so it can grow in place.
+    size_t last;
+} ScratchBlock;
+
+// The newest block comes first. The oldest one is kept between compiles.
+static ScratchBlock* blocks = NULL;
+
+static size_t alignUp(size_t size, size_t alignment) {
+    return (size + alignment - 1) & ~(alignment - 1);
+}
+
+static size_t blockStart() {
+    return alignUp(sizeof(ScratchBlock), SCRATCH_ALIGNMENT);
+}
+
+static ScratchBlock* newBlock(size_t minimum) {
+    size_t size = blockStart() + minimum;
+    if (size < SCRATCH_BLOCK_SIZE) {
+        size = SCRATCH_BLOCK_SIZE;
+    }
+    ScratchBlock* block = (ScratchBlock*) malloc(size);
+    if (block == NULL) {
+        exit(1);
+    }
+    block->next = blocks;
+    block->size = size;
+    block->used = blockStart();
+    block->last = block->used;
+    blocks = block;
+    return block;
+}
+
+// Buffers double as they grow, so the ones left behind when a buffer moves add
+// up to less than its final size.
+void* scratchGrow(void* pointer, size_t oldSize, size_t newSize) {
+    ScratchBlock* block = blocks;
+    if (pointer != NULL && block != NULL && (char*) pointer == (char*) block + block->last
+            && block->last + newSize <= block->size) {
+        block->used = alignUp(block->last + newSize, SCRATCH_ALIGNMENT);
+        return pointer;
+    }
+
+    size_t size = alignUp(newSize, SCRATCH_ALIGNMENT);
+    if (block == NULL || block->used + size > block->size) {
+        block = newBlock(size);
+    }
+    void* result = (char*) block + block->used;
+    block->last = block->used;
+    block->used += size;
+    if (oldSize > 0) {
+        memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+    }
+    return result;
+}
+
+void releaseScratch() {
+    while (blocks != NULL && blocks->next != NULL) {
+        ScratchBlock* next = blocks->next;
+        free(blocks);
+        blocks = next;
+    }
+    if (blocks != NULL) {
+        blocks->used = blockStart();
+        blocks->last = blocks->used;
+    }
+}
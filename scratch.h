@@ -0,0 +1,15 @@
+#pragma once
+
+#include "common.h"
+
+// A bump allocator for buffers that only live while a script or a lazy
+// function is being compiled. Nothing in it counts towards vm.bytesAllocated
+// or can start a collection, and releaseScratch() drops all of it at once.
+void* scratchGrow(void* pointer, size_t oldSize, size_t newSize);
+void releaseScratch();
+
+template <typename T>
+T *growScratchArray(T *pointer, int oldCount, int newCount)
+{
+    return (T *)scratchGrow(pointer, sizeof(T) * oldCount, sizeof(T) * newCount);
+}
@@ -1,7 +1,10 @@
 #include "serialize.h"
 #include <typeinfo>
 
-void serializeConstantVals(serializationPackage::Context* context, ObjFunction* locationOfFunction){
+int vmdataVersion = 2;
+const uint32_t VMDATA_VERSION = 2;
+
+void serializeConstantVals(serializationPackage::Context* context, const ObjFunction* locationOfFunction){
     auto& contextConstantMap = *(context->mutable_constantvals());
     std::string name = context->contextname();
     for (int i = 0; i < locationOfFunction->chunk.constants.count; i++){
@@ -25,9 +28,11 @@ void serializeConstantVals(serializationPackage::Context* context, ObjFunction*
     }
 }
 
-void serializeContexts(serializationPackage::VMData* vmData, std::vector<ObjFunction*> locationOfFunctions,
-    std::unordered_map<std::string, std::set<uint64_t>> locationsOfNonInstructions, 
-    std::unordered_map<uint64_t, std::vector<Upvalue>> locationOfUpvalues){
+void serializeContexts(serializationPackage::VMData* vmData, const std::vector<ObjFunction*>& locationOfFunctions,
+    const std::unordered_map<std::string, std::set<uint64_t>>& locationsOfNonInstructions, 
+    const std::unordered_map<uint64_t, std::vector<Upvalue>>& locationOfUpvalues){
+    const std::set<uint64_t> noOffsets;
+    const std::vector<Upvalue> noUpvalues;
     for (auto& element: locationOfFunctions){
         serializationPackage::Context* context = vmData->add_contexts();
         context->set_functionaddress((uint64_t) element);
@@ -43,6 +48,9 @@ void serializeContexts(serializationPackage::VMData* vmData, std::vector<ObjFunc
         context->set_upvaluecount(element->upvalueCount);
         context->set_arity(element->arity);
         auto& contextInstructionMap = *(context->mutable_instructionvals());
+        auto nonInstructions = locationsOfNonInstructions.find(context_name_temp);
+        const std::set<uint64_t>& operandOffsets = nonInstructions != locationsOfNonInstructions.end()
+            ? nonInstructions->second : noOffsets;
         // for (auto& [key, value]: locationsOfNonInstructions){
         //     // std::cout << "Printing key: " << key;
         //     // for (auto& address: value){
@@ -55,8 +63,7 @@ void serializeContexts(serializationPackage::VMData* vmData, std::vector<ObjFunc
             uint64_t address = (uint64_t) element->chunk.code + i;
             serializationPackage::InstructionType instructionType;
 
-            if (locationsOfNonInstructions[context_name_temp].find(address) != 
-                locationsOfNonInstructions[context_name_temp].end()){
+            if (operandOffsets.find(i) != operandOffsets.end()){
                 uint64_t addressValue = (uint64_t) (*(element->chunk.code + i));
                 instructionType.set_addressorconstant(addressValue);
                 // std::cout << "Found element: " << context_name_temp << " and " << addressValue << std::endl;
@@ -74,7 +81,8 @@ void serializeContexts(serializationPackage::VMData* vmData, std::vector<ObjFunc
             // context.mutable_instructionvals()->;
         }
 
-        std::vector<Upvalue> upvalues = locationOfUpvalues[(uint64_t) element];
+        auto found = locationOfUpvalues.find((uint64_t) element);
+        const std::vector<Upvalue>& upvalues = found != locationOfUpvalues.end() ? found->second : noUpvalues;
         for (int i = 0; i < upvalues.size(); i++){
             serializationPackage::Upvalue* upValueVector = context->add_upvalues();
             upValueVector->set_index(upvalues[i].index);
@@ -86,30 +94,93 @@ void serializeContexts(serializationPackage::VMData* vmData, std::vector<ObjFunc
     }
 }
 
-void serializeStrings(serializationPackage::VMData* vmData, Table stringTable){
+void serializeStrings(serializationPackage::VMData* vmData, const std::vector<ObjString*>& strings){
     auto& vmDataMap = *(vmData->mutable_stringsataddresses());
-    for (int i = 0; i < stringTable.capacity; i++){
-        Entry entry = stringTable.entries[i];
-        if (entry.key != NULL){
-            // std::cout<<"Printing entry's string " << entry.key->chars << std::endl;
-            serializationPackage::VMData_AddressAndHash addressAndHash;
-            addressAndHash.set_address(reinterpret_cast<uintptr_t>(entry.key));
-            addressAndHash.set_hash(entry.key->hash);
-            vmDataMap[entry.key->chars] = addressAndHash;
-        }
+    for (ObjString* key : strings){
+        // std::cout<<"Printing entry's string " << key->chars << std::endl;
+        serializationPackage::VMData_AddressAndHash addressAndHash;
+        addressAndHash.set_address(reinterpret_cast<uintptr_t>(key));
+        addressAndHash.set_hash(key->obj.hash);
+        vmDataMap[key->chars] = addressAndHash;
     }
 }
 
-serializationPackage::VMData serializeVMData(VM vm, std::vector<ObjFunction*> locationOfFunctions, 
-        std::unordered_map<std::string, std::set<uint64_t>> locationsOfNonInstructions,
-        std::unordered_map<uint64_t, std::vector<Upvalue>> locationOfUpvalues){
+serializationPackage::VMData serializeVMData(const std::vector<ObjString*>& strings, const std::vector<ObjFunction*>& locationOfFunctions, 
+        const std::unordered_map<std::string, std::set<uint64_t>>& locationsOfNonInstructions,
+        const std::unordered_map<uint64_t, std::vector<Upvalue>>& locationOfUpvalues){
     serializationPackage::VMData vmdata;
     serializationPackage::ValueType valueType;
     serializeContexts(&vmdata, locationOfFunctions, locationsOfNonInstructions, locationOfUpvalues);
     // serializeClosures(&vmdata, locationOfUpvalues);
     // serializeConstants(&vmdata, vm.chunk);
-    serializeStrings(&vmdata, vm.strings);
+    serializeStrings(&vmdata, strings);
     // serializeInstructions(&vmdata, vm.chunk);
-    std::cout<< vmdata.DebugString();
     return vmdata;
 }
+
+static int stringIndex(serializationPackage::VMDataV2* vmData,
+        std::unordered_map<ObjString*, int>& strings, ObjString* string){
+    auto found = strings.find(string);
+    if (found != strings.end()){
+        return found->second;
+    }
+    int index = vmData->strings_size();
+    vmData->add_strings(string->chars, string->length);
+    strings[string] = index;
+    return index;
+}
+
+// Lines are stored as runs since a statement usually spans several bytes.
+static void serializeLinesV2(serializationPackage::FunctionV2* function, Chunk* chunk){
+    for (int i = 0; i < chunk->lineCount; i++){
+        int end = i + 1 < chunk->lineCount ? chunk->lines[i + 1].offset : chunk->count;
+        function->add_lines(chunk->lines[i].line);
+        function->add_lines(end - chunk->lines[i].offset);
+    }
+}
+
+static void serializeConstantsV2(serializationPackage::VMDataV2* vmData, serializationPackage::FunctionV2* function,
+        Chunk* chunk, std::unordered_map<ObjString*, int>& strings,
+        const std::unordered_map<ObjFunction*, int>& functionIndices){
+    for (int i = 0; i < chunk->constants.count; i++){
+        Value value = chunk->constants.values[i];
+        serializationPackage::ConstantV2* constant = function->add_constants();
+        if (isBool(value)){
+            constant->set_boolean(asBool(value));
+        } else if (isNumber(value)){
+            constant->set_number(asNumber(value));
+        } else if (isObj(value) && isString(value)){
+            constant->set_stringindex(stringIndex(vmData, strings, asString(value)));
+        } else if (isObj(value) && isFunction(value)){
+            constant->set_functionindex(functionIndices.at(asFunction(value)));
+        }
+    }
+}
+
+// functions lists every function the compiler produced, script included.
+serializationPackage::VMDataV2 serializeVMDataV2(const std::vector<ObjFunction*>& functions, ObjFunction* script){
+    serializationPackage::VMDataV2 vmData;
+    vmData.set_version(VMDATA_VERSION);
+    for (int opcode = 0; opcode <= OP_POP_SCOPED; opcode++){
+        vmData.add_operandbytes(operandBytes(opcode));
+    }
+
+    std::unordered_map<ObjFunction*, int> functionIndices;
+    for (ObjFunction* function : functions){
+        functionIndices.emplace(function, (int) functionIndices.size());
+    }
+    vmData.set_script(functionIndices.at(script));
+
+    std::unordered_map<ObjString*, int> strings;
+    for (ObjFunction* element : functions){
+        serializationPackage::FunctionV2* function = vmData.add_functions();
+        function->set_name(element->name != NULL ? stringIndex(&vmData, strings, element->name) : -1);
+        function->set_arity(element->arity);
+        function->set_upvaluecount(element->upvalueCount);
+        function->set_thisdoesnotescape(!element->thisEscapes);
+        function->set_code(element->chunk.code, element->chunk.count);
+        serializeLinesV2(function, &element->chunk);
+        serializeConstantsV2(&vmData, function, &element->chunk, strings, functionIndices);
+    }
+    return vmData;
+}
@@ -4,6 +4,12 @@
 #include "vm.h"
 #include "compiler.h"
 
-serializationPackage::VMData serializeVMData(VM vmStateInfo, std::vector<ObjFunction*> locationOfFunctions, 
-    std::unordered_map<std::string, std::set<uint64_t>> locationsOfNonInstructions,
-    std::unordered_map<uint64_t, std::vector<Upvalue>> locationOfUpvalues);
\ No newline at end of file
+// strings are the interned strings, listed by address.
+serializationPackage::VMData serializeVMData(const std::vector<ObjString*>& strings, const std::vector<ObjFunction*>& locationOfFunctions, 
+    const std::unordered_map<std::string, std::set<uint64_t>>& locationsOfNonInstructions,
+    const std::unordered_map<uint64_t, std::vector<Upvalue>>& locationOfUpvalues);
+
+// The VMData format --export-vmdata writes, 1 or 2.
+extern int vmdataVersion;
+
+serializationPackage::VMDataV2 serializeVMDataV2(const std::vector<ObjFunction*>& functions, ObjFunction* script);
@@ -0,0 +1,109 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "source.h"
+
+const size_t SOURCE_READ_CHUNK = 64 * 1024;
+
+static void readFailed(const char* path) {
+    fprintf(stderr, "Could not read file \"%s\".\n", path);
+    exit(74);
+}
+
+// Reserves the file's size plus at least one page of zeroes and maps the file
+// over the front of it, so the byte after the text reads as NUL whether or
+// not the file ends on a page boundary.
+static bool mapSource(int fd, size_t length, Source* source) {
+    size_t pageSize = (size_t) sysconf(_SC_PAGESIZE);
+    size_t mappedSize = (length / pageSize + 1) * pageSize;
+    void* mapping = mmap(NULL, mappedSize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+    if (length > 0) {
+        void* text = mmap(mapping, length, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0);
+        if (text == MAP_FAILED) {
+            munmap(mapping, mappedSize);
+            return false;
+        }
+        madvise(mapping, length, MADV_SEQUENTIAL);
+    }
+    source->chars = (const char*) mapping;
+    source->length = length;
+    source->mappedSize = mappedSize;
+    return true;
+}
+
+static void streamSource(FILE* file, const char* path, Source* source) {
+    size_t capacity = SOURCE_READ_CHUNK;
+    size_t length = 0;
+    char* buffer = (char*) malloc(capacity);
+    for (;;) {
+        if (buffer == NULL) {
+            fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
+            exit(74);
+        }
+        length += fread(buffer + length, sizeof(char), capacity - length - 1, file);
+        if (length < capacity - 1) {
+            break;
+        }
+        capacity *= 2;
+        buffer = (char*) realloc(buffer, capacity);
+    }
+    if (ferror(file)) {
+        readFailed(path);
+    }
+    buffer[length] = '\0';
+    source->chars = buffer;
+    source->length = length;
+    source->mappedSize = 0;
+}
+
+// Loads the script at path, or standard input when path is "-".
+void loadSource(const char* path, Source* source) {
+    if (strcmp(path, "-") == 0) {
+        streamSource(stdin, "<stdin>", source);
+        return;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        exit(74);
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        readFailed(path);
+    }
+    if (S_ISREG(info.st_mode) && mapSource(fd, (size_t) info.st_size, source)) {
+        // The mapping keeps the file's pages alive on its own.
+        close(fd);
+        return;
+    }
+
+    FILE* file = fdopen(fd, "rb");
+    if (file == NULL) {
+        readFailed(path);
+    }
+    streamSource(file, path, source);
+    fclose(file);
+}
+
+void freeSource(Source* source) {
+    if (source->chars == NULL) {
+        return;
+    }
+    if (source->mappedSize > 0) {
+        munmap((void*) source->chars, source->mappedSize);
+    } else {
+        free((void*) source->chars);
+    }
+    source->chars = NULL;
+    source->length = 0;
+    source->mappedSize = 0;
+}
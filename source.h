@@ -0,0 +1,17 @@
+#pragma once
+
+#include "common.h"
+
+// A script's text, always followed by a NUL the scanner can stop at. Regular
+// files are mapped straight from the page cache with at least one zeroed byte
+// after the last character; stdin, pipes and anything else that can't be
+// mapped are read into a growing buffer instead. mappedSize is zero for
+// those.
+typedef struct {
+    const char* chars;
+    size_t length;
+    size_t mappedSize;
+} Source;
+
+void loadSource(const char* path, Source* source);
+void freeSource(Source* source);
@@ -1,5 +1,8 @@
 #include <stdlib.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "memory.h"
 #include "object.h"
@@ -7,91 +10,245 @@
 #include "value.h"
 
 double TABLE_MAX_LOAD = 0.75;
+// Rehash in place instead of growing once this share of slots are tombstones.
+double TABLE_MAX_TOMBSTONES = 0.25;
+// tableCompact() shrinks tables that have fallen below this load.
+double TABLE_MIN_LOAD = 0.2;
 
 void initTable(Table* table) {
     table->count = 0;
+    table->tombstones = 0;
     table->capacity = 0;
-    table->entries = NULL;
+    table->control = NULL;
+    table->keys = NULL;
+    table->values = NULL;
+}
+
+// The control bytes, keys and values share one block, in that order.
+size_t tableBytes(int capacity) {
+    return (size_t) capacity * (sizeof(uint8_t) + sizeof(Ref<ObjString>) + sizeof(Value));
 }
 
 void freeTable(Table* table) {
-    freeArray<Entry>(table->entries, table->capacity);
+    if (table->capacity > 0) {
+        freeArray<uint8_t>(table->control, tableBytes(table->capacity));
+    }
     initTable(table);
 }
 
-static Entry* findEntry(Entry* entries, int capacity, ObjString* key){
-    uint32_t index = key->hash % capacity;
-    Entry* tombstone = NULL;
+static uint8_t hashTag(uint32_t hash) {
+    return hash & 0x7f;
+}
+
+static int firstGroup(Table* table, uint32_t hash) {
+    return (hash >> 7) & (table->capacity / TABLE_GROUP_SIZE - 1);
+}
+
+// Groups are visited in triangular order, which reaches every group when
+// their number is a power of two.
+static int nextGroup(Table* table, int group, int step) {
+    return (group + step) & (table->capacity / TABLE_GROUP_SIZE - 1);
+}
+
+// Bit i of each mask is set when slot i of the group matches.
+#ifdef __SSE2__
+
+static uint32_t matchTag(const uint8_t* group, uint8_t tag) {
+    __m128i control = _mm_load_si128((const __m128i*) group);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8((char) tag)));
+}
+
+static uint32_t matchEmptyOrDeleted(const uint8_t* group) {
+    return _mm_movemask_epi8(_mm_load_si128((const __m128i*) group));
+}
+
+#else
+
+static uint32_t matchTag(const uint8_t* group, uint8_t tag) {
+    uint32_t mask = 0;
+    for (int i = 0; i < TABLE_GROUP_SIZE; i++) {
+        if (group[i] == tag) {
+            mask |= 1u << i;
+        }
+    }
+    return mask;
+}
+
+static uint32_t matchEmptyOrDeleted(const uint8_t* group) {
+    uint32_t mask = 0;
+    for (int i = 0; i < TABLE_GROUP_SIZE; i++) {
+        if (group[i] & 0x80) {
+            mask |= 1u << i;
+        }
+    }
+    return mask;
+}
+
+#endif
+
+static uint32_t matchEmpty(const uint8_t* group) {
+    return matchTag(group, TABLE_EMPTY);
+}
+
+static int lowestBit(uint32_t mask) {
+    return __builtin_ctz(mask);
+}
 
-    for (;;){
-        Entry* entry = &entries[index];
-        if (entry->key == NULL){
-            if (isNil(entry->value)){
-                return tombstone != NULL ? tombstone : entry;
-            } else{
-                if (tombstone == NULL){
-                    tombstone = entry;
-                }
+// Returns the slot holding key, or -1. Keys are interned so pointer equality
+// is enough once the tag matches.
+static int findSlot(Table* table, ObjString* key) {
+    uint32_t hash = key->obj.hash;
+    uint8_t tag = hashTag(hash);
+    int group = firstGroup(table, hash);
+    for (int step = 1;; step++) {
+        const uint8_t* control = table->control + group * TABLE_GROUP_SIZE;
+        for (uint32_t matches = matchTag(control, tag); matches != 0; matches &= matches - 1) {
+            int index = group * TABLE_GROUP_SIZE + lowestBit(matches);
+            if (table->keys[index] == key) {
+                return index;
             }
-        } else if (entry->key == key){
-            return entry;
         }
+        if (matchEmpty(control) != 0) {
+            return -1;
+        }
+        group = nextGroup(table, group, step);
+    }
+}
+
+// The first empty or deleted slot on the probe sequence for hash.
+static int findFreeSlot(Table* table, uint32_t hash) {
+    int group = firstGroup(table, hash);
+    for (int step = 1;; step++) {
+        uint32_t free = matchEmptyOrDeleted(table->control + group * TABLE_GROUP_SIZE);
+        if (free != 0) {
+            return group * TABLE_GROUP_SIZE + lowestBit(free);
+        }
+        group = nextGroup(table, group, step);
+    }
+}
 
-        index = (index + 1) % capacity;
+// A deleted slot can go straight back to empty when its group still has an
+// empty slot: probes stop at such a group, so no key was ever placed beyond
+// it on account of this slot.
+static void clearSlot(Table* table, int index) {
+    const uint8_t* group = table->control + index / TABLE_GROUP_SIZE * TABLE_GROUP_SIZE;
+    if (matchEmpty(group) != 0) {
+        table->control[index] = TABLE_EMPTY;
+    } else {
+        table->control[index] = TABLE_DELETED;
+        table->tombstones++;
     }
+    table->keys[index] = NULL;
+    table->values[index] = nilVal();
+    table->count--;
 }
 
-static void adjustCapacity(Table* table, int capacity) {
-    Entry* entries = allocate<Entry>(capacity);
-    for (int i = 0; i < capacity; i++){
-        entries[i].key = NULL;
-        entries[i].value = nilVal();
+static int findInlineSlot(Table* table, ObjString* key) {
+    for (int i = 0; i < table->count; i++) {
+        if (table->inlineKeys[i] == key) {
+            return i;
+        }
     }
+    return -1;
+}
 
-    table->count = 0;
-    for (int i = 0; i < table->capacity; i++){
-        Entry* entry = &table->entries[i];
-        if (entry->key == NULL) {
+// Keeps inline entries packed by moving the last one into the hole.
+static void removeInlineSlot(Table* table, int index) {
+    table->count--;
+    table->inlineKeys[index] = table->inlineKeys[table->count];
+    table->inlineValues[index] = table->inlineValues[table->count];
+}
+
+static void adjustCapacity(Table* table, int capacity) {
+    uint8_t* block = allocate<uint8_t>(tableBytes(capacity));
+    Table resized;
+    resized.count = 0;
+    resized.tombstones = 0;
+    resized.capacity = capacity;
+    resized.control = block;
+    resized.keys = (Ref<ObjString>*) (block + capacity);
+    resized.values = (Value*) (block + capacity + sizeof(Ref<ObjString>) * capacity);
+    memset(resized.control, TABLE_EMPTY, capacity);
+
+    Ref<ObjString>* keys = tableKeys(table);
+    Value* values = tableValues(table);
+    for (int i = 0; i < tableSlots(table); i++){
+        if (!tableSlotInUse(table, i)) {
             continue;
         }
-        Entry* dest = findEntry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
-        table->count++;
+        ObjString* key = keys[i];
+        int index = findFreeSlot(&resized, key->obj.hash);
+        resized.control[index] = hashTag(key->obj.hash);
+        resized.keys[index] = key;
+        resized.values[index] = values[i];
+        resized.count++;
     }
 
-    freeArray<Entry>(table->entries, table->capacity);
-    table->entries = entries;
-    table->capacity = capacity;
+    if (table->capacity > 0) {
+        freeArray<uint8_t>(table->control, tableBytes(table->capacity));
+    }
+    *table = resized;
 }
 
 bool tableGet(Table* table, ObjString* key, Value* value){
     if (table->count == 0){
         return false;
     }
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL){
+    if (table->capacity == 0) {
+        int index = findInlineSlot(table, key);
+        if (index < 0) {
+            return false;
+        }
+        *value = table->inlineValues[index];
+        return true;
+    }
+    int index = findSlot(table, key);
+    if (index < 0){
         return false;
     }
 
-    *value = entry->value;
+    *value = table->values[index];
     return true;
 }
 
 bool tableSet(Table* table, ObjString* key, Value value){
-    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD){
-        int capacity = growCapacity(table->capacity);
-        adjustCapacity(table, capacity);
+    if (table->capacity == 0) {
+        int index = findInlineSlot(table, key);
+        if (index >= 0) {
+            table->inlineValues[index] = value;
+            return false;
+        }
+        if (table->count < TABLE_INLINE_ENTRIES) {
+            table->inlineKeys[table->count] = key;
+            table->inlineValues[table->count] = value;
+            table->count++;
+            return true;
+        }
+    } else {
+        int index = findSlot(table, key);
+        if (index >= 0) {
+            table->values[index] = value;
+            return false;
+        }
     }
 
+    if (table->count + table->tombstones + 1 > table->capacity * TABLE_MAX_LOAD){
+        if (table->capacity > 0 && table->tombstones >= table->capacity * TABLE_MAX_TOMBSTONES) {
+            adjustCapacity(table, table->capacity);
+        } else {
+            int capacity = table->capacity == 0 ? TABLE_GROUP_SIZE : table->capacity * 2;
+            adjustCapacity(table, capacity);
+        }
+    }
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    bool isNewKey = entry->key == NULL;
-    if (isNewKey && isNil(entry->value)) table->count++;
+    int index = findFreeSlot(table, key->obj.hash);
+    if (table->control[index] == TABLE_DELETED) table->tombstones--;
+    table->count++;
 
-    entry->key = key;
-    entry->value = value;
-    return isNewKey;
+    table->control[index] = hashTag(key->obj.hash);
+    table->keys[index] = key;
+    table->values[index] = value;
+    return true;
 }
 
 bool tableDelete(Table* table, ObjString* key){
@@ -99,60 +256,124 @@ bool tableDelete(Table* table, ObjString* key){
         return false;
     }
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL){
+    if (table->capacity == 0) {
+        int index = findInlineSlot(table, key);
+        if (index < 0) {
+            return false;
+        }
+        removeInlineSlot(table, index);
+        return true;
+    }
+
+    int index = findSlot(table, key);
+    if (index < 0){
         return false;
     }
 
-    entry->key = NULL;
-    entry->value = boolVal(true);
+    clearSlot(table, index);
     return true;
 }
 
+// Makes room for count entries up front so filling the table doesn't
+// resize it on the way.
+void tableReserve(Table* table, int count) {
+    if (count <= TABLE_INLINE_ENTRIES || count <= table->capacity * TABLE_MAX_LOAD) {
+        return;
+    }
+    int capacity = TABLE_GROUP_SIZE;
+    while (count > capacity * TABLE_MAX_LOAD) {
+        capacity *= 2;
+    }
+    adjustCapacity(table, capacity);
+}
+
 void tableAddAll(Table* from, Table* to){
-    for (int i = 0; i < from->capacity; i++){
-        Entry* entry = &from->entries[i];
-        if (entry->key != NULL) {
-            tableSet(to, entry->key, entry->value);
+    Ref<ObjString>* keys = tableKeys(from);
+    Value* values = tableValues(from);
+    for (int i = 0; i < tableSlots(from); i++){
+        if (tableSlotInUse(from, i)) {
+            tableSet(to, keys[i], values[i]);
         }
     }
 }
 
-ObjString* tableFindString(Table* table, const char* chars, 
+ObjString* tableFindString(Table* table, const char* chars,
                             int length, uint32_t hash){
     if (table->count == 0){
         return NULL;
     }
-    uint32_t index = hash % table->capacity;
-    for (;;){
-        Entry* entry = &table->entries[index];
-        if (entry->key == NULL) {
-            if (isNil(entry->value)){
-                return NULL;
+    if (table->capacity == 0) {
+        for (int i = 0; i < table->count; i++) {
+            ObjString* key = table->inlineKeys[i];
+            if (key->length == length && key->obj.hash == hash
+                    && memcmp(key->chars, chars, length) == 0) {
+                return key;
             }
         }
-        else if (entry->key->length == length && entry->key->hash == hash  
-                    && memcmp(entry->key->chars, chars, length) == 0){
-            return entry->key;
+        return NULL;
+    }
+    uint8_t tag = hashTag(hash);
+    int group = firstGroup(table, hash);
+    for (int step = 1;; step++) {
+        const uint8_t* control = table->control + group * TABLE_GROUP_SIZE;
+        for (uint32_t matches = matchTag(control, tag); matches != 0; matches &= matches - 1) {
+            ObjString* key = table->keys[group * TABLE_GROUP_SIZE + lowestBit(matches)];
+            if (key->length == length && key->obj.hash == hash
+                    && memcmp(key->chars, chars, length) == 0) {
+                return key;
+            }
         }
-
-        index = (index + 1) % table->capacity;
+        if (matchEmpty(control) != 0) {
+            return NULL;
+        }
+        group = nextGroup(table, group, step);
     }
 }
 
 void tableRemoveWhite(Table* table) {
+    if (table->capacity == 0) {
+        for (int i = table->count - 1; i >= 0; i--) {
+            if (!table->inlineKeys[i]->obj.isMarked) {
+                removeInlineSlot(table, i);
+            }
+        }
+        return;
+    }
     for (int i = 0; i < table->capacity; i++){
-        Entry* entry = &table->entries[i];
-        if (entry->key != NULL && !entry->key->obj.isMarked) {
-            tableDelete(table, entry->key);
+        if (tableSlotInUse(table, i) && !table->keys[i]->obj.isMarked) {
+            clearSlot(table, i);
         }
     }
 }
 
+// Called on the intern table after each sweep. Shrinks it when most of its
+// strings have died and drops tombstones when they start to pile up.
+void tableCompact(Table* table) {
+    if (table->capacity <= TABLE_GROUP_SIZE) {
+        return;
+    }
+    if (table->count < table->capacity * TABLE_MIN_LOAD) {
+        int capacity = table->capacity;
+        while (capacity > TABLE_GROUP_SIZE && table->count < capacity / 2 * TABLE_MAX_LOAD / 2) {
+            capacity /= 2;
+        }
+        adjustCapacity(table, capacity);
+    } else if (table->tombstones >= table->capacity * TABLE_MAX_TOMBSTONES) {
+        adjustCapacity(table, table->capacity);
+    }
+}
+
+double tableLoadFactor(Table* table) {
+    return table->capacity == 0 ? 0 : (double) table->count / table->capacity;
+}
+
 void markTable(Table* table) {
-    for (int i = 0; i < table->capacity; i++){
-        Entry* entry = &table->entries[i];
-        markObject((Obj*)entry->key);
-        markValue(entry->value);
+    Ref<ObjString>* keys = tableKeys(table);
+    Value* values = tableValues(table);
+    for (int i = 0; i < tableSlots(table); i++){
+        if (tableSlotInUse(table, i)) {
+            markObject((Obj*) keys[i]);
+            markValue(values[i]);
+        }
     }
-}
\ No newline at end of file
+}
@@ -3,26 +3,65 @@
 #include "common.h"
 #include "value.h"
 
-typedef struct {
-    ObjString* key;
-    Value value;
-} Entry;
+// While capacity is zero a table holds up to TABLE_INLINE_ENTRIES entries
+// inline, packed at the front and found by comparing key pointers (keys are
+// interned). Past that it switches to open addressing with one control byte
+// per slot, probed a 16 slot group at a time. A control byte holds the low 7
+// bits of the key's hash when the slot is in use, or one of the markers
+// below. capacity is then a power of two of at least TABLE_GROUP_SIZE.
+const int TABLE_INLINE_ENTRIES = 4;
+const int TABLE_GROUP_SIZE = 16;
+const uint8_t TABLE_EMPTY = 0x80;
+const uint8_t TABLE_DELETED = 0xfe;
 
 typedef struct {
     int count;
+    int tombstones;
     int capacity;
-    Entry* entries;
+    union {
+        struct {
+            uint8_t* control;
+            Ref<ObjString>* keys;
+            Value* values;
+        };
+        struct {
+            Ref<ObjString> inlineKeys[TABLE_INLINE_ENTRIES];
+            Value inlineValues[TABLE_INLINE_ENTRIES];
+        };
+    };
 } Table;
 
+// Walk a table in either layout with
+//   for (int i = 0; i < tableSlots(table); i++) if (tableSlotInUse(table, i)) ...
+static inline int tableSlots(Table* table) {
+    return table->capacity == 0 ? table->count : table->capacity;
+}
+
+static inline bool tableSlotInUse(Table* table, int index) {
+    return table->capacity == 0 || table->control[index] < TABLE_EMPTY;
+}
+
+static inline Ref<ObjString>* tableKeys(Table* table) {
+    return table->capacity == 0 ? table->inlineKeys : table->keys;
+}
+
+static inline Value* tableValues(Table* table) {
+    return table->capacity == 0 ? table->inlineValues : table->values;
+}
+
 void initTable(Table* table);
 void freeTable(Table* table);
+size_t tableBytes(int capacity);
 bool tableGet(Table* table, ObjString* key, Value* value);
 bool tableSet(Table* table, ObjString* key, Value value);
 bool tableDelete(Table* table, ObjString* key);
 void tableAddAll(Table* from, Table* to);
+void tableReserve(Table* table, int count);
 ObjString* tableFindString(Table* table, const char* chars,
                             int length, uint32_t hash);
-void tableRemoveWhite(Table* table);                        
+void tableRemoveWhite(Table* table);
+void tableCompact(Table* table);
+double tableLoadFactor(Table* table);
 void markTable(Table* table);
 
 
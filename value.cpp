@@ -104,7 +104,12 @@ bool valuesEqual(Value a, Value b){
         case VAL_NUMBER:
             return asNumber(a) == asNumber(b);
         case VAL_OBJ: {
-            return asObj(a) == asObj(b);
+            if (asObj(a) == asObj(b)) {
+                return true;
+            }
+            // Both operands must be reachable by the GC, comparing a rope
+            // flattens it.
+            return isString(a) && isString(b) && stringsEqual(a, b);
         }
         default: 
             return false;
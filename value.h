@@ -1,6 +1,7 @@
 #pragma once
 
 #include "common.h"
+#include "cage.h"
 
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
@@ -12,14 +13,20 @@ typedef enum {
     VAL_OBJ
 } ValueType;
 
+#ifdef LOX_COMPRESSED_POINTERS
+#pragma pack(push, 4)
+#endif
 typedef struct {
     ValueType type;
     union {
         bool boolean;
         double number;
-        Obj* obj;
+        Ref<Obj> obj;
     } as;
 } Value;
+#ifdef LOX_COMPRESSED_POINTERS
+#pragma pack(pop)
+#endif
 
 Value objVal(Obj* obj);
 Value boolVal(bool value);
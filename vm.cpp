@@ -1,13 +1,11 @@
 #include <string.h>
 #include <time.h>
+#include <stdarg.h>
 #include "vm.h"
-#include "compiler.h"
 #include "common.h"
 #include "debug.h"
-#include "vmdata.pb.h"
-#include "serialize.h"
 #include "memory.h"
-#include <fstream>
+#include "census.h"
 
 
 std::string arrayForPrinting[] = {
@@ -39,15 +37,39 @@ std::string arrayForPrinting[] = {
 };
 
 VM vm;
+VMHooks vmHooks;
 
 static Value clockNative(int argCount, Value* args) {
     return numberVal((double) clock() / CLOCKS_PER_SEC);
 }
 
+static Value heapCensusNative(int argCount, Value* args) {
+    printHeapCensus(stdout);
+    return nilVal();
+}
+
+static Value heapDumpNative(int argCount, Value* args) {
+    if (argCount < 1 || !isString(args[0])) {
+        serviceHeapDumpRequest();
+        return nilVal();
+    }
+    return boolVal(dumpHeapSnapshot(asCstring(args[0])));
+}
+
+static void releaseScopedInstance() {
+    ObjInstance* instance = &vm.scopedInstances[--vm.scopedCount];
+    freeTable(&instance->fields);
+    instance->obj.isAllocated = false;
+}
+
 static void resetStack() {
     vm.stackTop = vm.stack;
     vm.frameCount = 0;
-    vm.openUpvalues = NULL;
+    memset(vm.openUpvalues, 0, sizeof(vm.openUpvalues));
+    vm.openUpvalueCount = 0;
+    while (vm.scopedCount > 0) {
+        releaseScopedInstance();
+    }
 }
 
 static void runtimeError(const char* format, ...) {
@@ -60,7 +82,7 @@ static void runtimeError(const char* format, ...) {
         CallFrame* frame = &vm.frames[i];
         ObjFunction* function = frame->closure->function;
         size_t instruction = frame->ip - function->chunk.code - 1;
-        int line = function->chunk.lines[instruction];
+        int line = getLine(&function->chunk, (int) instruction);
         fprintf(stderr, "[line %d] in script\n", line);
         if (function->name == NULL) {
             fprintf(stderr, "script\n");
@@ -79,9 +101,18 @@ static void defineNative(const char* name, NativeFn function) {
     pop();
 }
 
+// Must be called before initVM() so the VM's own objects land in the arena.
+void enableArenaMode(size_t limit, ArenaFallback fallback) {
+    vm.arenaMode = true;
+    vm.arenaLimit = limit;
+    vm.arenaFallback = fallback;
+}
+
 void initVM() {
+    initCage();
+    vm.scopedInstances = (ObjInstance*) cageReserve(sizeof(ObjInstance) * STACK_MAX);
+    vm.scopedCount = 0;
     resetStack();
-    vm.objects = NULL;
     vm.bytesAllocated = 0;
     vm.nextGC = 1024 * 1024;
 
@@ -96,9 +127,15 @@ void initVM() {
     vm.initString = copyString("init", 4);
 
     defineNative("clock", clockNative);
+    defineNative("heapCensus", heapCensusNative);
+    defineNative("heapDump", heapDumpNative);
+    installHeapDumpSignal();
 }
 
 void freeVM() {
+    if (vmHooks.beforeFree != NULL) {
+        vmHooks.beforeFree();
+    }
     freeTable(&vm.globals);
     freeTable(&vm.strings);
     vm.initString = NULL;
@@ -132,6 +169,11 @@ static bool call(ObjClosure* closure, int argCount) {
         return false;
     }
 
+    if (closure->function->lazy != NULL && !vmHooks.compileFunction(closure->function)) {
+        runtimeError("Could not compile %s.", closure->function->name->chars);
+        return false;
+    }
+
     CallFrame* frame = &vm.frames[vm.frameCount++];
     frame->closure = closure;
     frame->ip = closure->function->chunk.code;
@@ -139,6 +181,72 @@ static bool call(ObjClosure* closure, int argCount) {
     return true;
 }
 
+// Own methods win over inherited ones, which keeps overriding as it was when
+// OP_INHERIT copied the superclass's methods. A hit further up the chain is
+// cached in the class so the walk happens once per class and name.
+static bool findMethod(ObjClass* klass, ObjString* name, Value* method) {
+    if (tableGet(&klass->methods, name, method)) {
+        return true;
+    }
+    if (klass->superclass == NULL) {
+        return false;
+    }
+    if (tableGet(&klass->methodCache, name, method)) {
+        return true;
+    }
+    for (ObjClass* ancestor = klass->superclass; ancestor != NULL; ancestor = ancestor->superclass) {
+        if (tableGet(&ancestor->methods, name, method)) {
+            tableSet(&klass->methodCache, name, *method);
+            return true;
+        }
+    }
+    return false;
+}
+
+// A scoped call only places the instance in the scoped storage when the
+// initializer, if any, keeps this to itself. The compiler has already checked
+// that the caller's local doesn't let it escape.
+static bool callClass(ObjClass* klass, int argCount, bool scoped) {
+    ObjClosure* initializer = klass->initializer;
+    Value* slot = vm.stackTop - argCount - 1;
+    ObjInstance* instance;
+    if (scoped && (initializer == NULL || !initializer->function->thisEscapes)) {
+        instance = placeInstance(&vm.scopedInstances[vm.scopedCount], klass);
+        vm.scopedSlots[vm.scopedCount++] = slot;
+    } else {
+        instance = newInstance(klass);
+    }
+    *slot = objVal((Obj*) instance);
+    // Sized once the instance is on the stack, as this can collect.
+    tableReserve(&instance->fields, klass->fieldCount);
+    if (initializer != NULL){
+        return call(initializer, argCount);
+    } else if (argCount != 0) {
+        runtimeError("Expected 0 arguments but got %d.", argCount);
+        return false;
+    }
+    return true;
+}
+
+static bool isScopedInstance(Obj* object) {
+    return (ObjInstance*) object >= vm.scopedInstances
+        && (ObjInstance*) object < vm.scopedInstances + STACK_MAX;
+}
+
+// Moves a scoped instance to the heap once something that can outlive its
+// local refers to it. Until then only the stack can hold it.
+static ObjInstance* promoteInstance(ObjInstance* scoped) {
+    ObjInstance* instance = newInstance(scoped->klass);
+    instance->fields = scoped->fields;
+    initTable(&scoped->fields);
+    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+        if (isObj(*slot) && asObj(*slot) == (Obj*) scoped) {
+            *slot = objVal((Obj*) instance);
+        }
+    }
+    return instance;
+}
+
 static bool callValue(Value callee, int argCount) {
     if (isObj(callee)){
         switch (objType(callee)){
@@ -147,17 +255,8 @@ static bool callValue(Value callee, int argCount) {
                 vm.stackTop[-argCount - 1] = bound->receiver;
                 return call(bound->method, argCount);
             }
-            case OBJ_CLASS: {
-                ObjClass* klass = asClass(callee);
-                vm.stackTop[-argCount - 1] = objVal((Obj*) newInstance(klass));
-                Value initializer;
-                if (tableGet(&klass->methods, vm.initString, &initializer)){
-                    return call(asClosure(initializer), argCount);
-                } else if (argCount != 0) {
-                    runtimeError("Expected 0 arguments but got %.", argCount);
-                }
-                return true;
-            }
+            case OBJ_CLASS:
+                return callClass(asClass(callee), argCount, false);
             case OBJ_CLOSURE:
                 return call(asClosure(callee), argCount);
             case OBJ_NATIVE: {
@@ -177,7 +276,7 @@ static bool callValue(Value callee, int argCount) {
 
 static bool invokeFromClass(ObjClass* klass, ObjString* name, int argCount) {
     Value method;
-    if (!tableGet(&klass->methods, name, &method)) {
+    if (!findMethod(klass, name, &method)) {
         runtimeError("Undefined property '%s'.", name->chars);
         return false;
     }
@@ -204,44 +303,49 @@ static bool invoke(ObjString* name, int argCount) {
 
 static bool bindMethod(ObjClass* klass, ObjString* name) {
     Value method;
-    if (!tableGet(&klass->methods, name, &method)) {
+    if (!findMethod(klass, name, &method)) {
         runtimeError("Undefined property '%s'.", name->chars);
         return false;
     }
 
+    if (isObj(peek(0)) && isScopedInstance(asObj(peek(0)))) {
+        promoteInstance(asInstance(peek(0)));
+    }
     ObjBoundMethod* bound = newBoundMethod(peek(0), asClosure(method));
     pop();
     push(objVal((Obj*) bound));
     return true;
 }
 
+// Open upvalues are indexed by stack slot, so capturing a variable that is
+// already captured is a single lookup.
 static ObjUpvalue* captureUpvalue(Value* local) {
-    ObjUpvalue* prevUpvalue = NULL;
-    ObjUpvalue* upvalue = vm.openUpvalues;
-    while (upvalue != NULL && upvalue->location > local) {
-        prevUpvalue = upvalue;
-        upvalue = upvalue->next;
-    }
-
-    if (upvalue != NULL && upvalue->location == local) {
-        return upvalue;
+    int slot = (int) (local - vm.stack);
+    if (vm.openUpvalues[slot] != NULL) {
+        return vm.openUpvalues[slot];
     }
 
     ObjUpvalue* createdUpvalue = newUpvalue(local);
-    if (prevUpvalue == NULL) {
-        vm.openUpvalues = createdUpvalue;
-    } else{
-        prevUpvalue->next = createdUpvalue;
-    }
+    vm.openUpvalues[slot] = createdUpvalue;
+    vm.openUpvalueCount++;
     return createdUpvalue;
 }
 
+static inline ObjUpvalue* upvalueBox(ObjClosure* closure, int slot) {
+    return (ObjUpvalue*) closure->upvalues[slot].as.obj;
+}
+
 static void closeUpvalues(Value* last) {
-    while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
-        ObjUpvalue* upvalue = vm.openUpvalues;
+    for (int slot = (int) (last - vm.stack);
+            vm.openUpvalueCount > 0 && slot < vm.stackTop - vm.stack; slot++) {
+        ObjUpvalue* upvalue = vm.openUpvalues[slot];
+        if (upvalue == NULL) {
+            continue;
+        }
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
-        vm.openUpvalues = upvalue->next;
+        vm.openUpvalues[slot] = NULL;
+        vm.openUpvalueCount--;
     }
 }
 
@@ -249,6 +353,12 @@ static void defineMethod(ObjString* name) {
     Value method = peek(0);
     ObjClass* klass = asClass(peek(1));
     tableSet(&klass->methods, name, method);
+    // Methods are only defined while the class body runs, before any
+    // subclass can exist, so only this class's caches can be stale.
+    freeTable(&klass->methodCache);
+    if (name == vm.initString) {
+        klass->initializer = asClosure(method);
+    }
     pop();
 }
 
@@ -257,15 +367,21 @@ static bool isFalsey(Value value) {
 }
 
 static void concatenate() {
+    int length = stringLength(peek(1)) + stringLength(peek(0));
+    if (length >= ROPE_MIN_LENGTH) {
+        ObjRope* rope = newRope(asObj(peek(1)), asObj(peek(0)));
+        pop();
+        pop();
+        push(objVal((Obj*) rope));
+        return;
+    }
+
+    // Unflattened ropes are never this short, so these do not allocate.
     ObjString* b = asString(peek(0));
     ObjString* a = asString(peek(1));
-    int length = a->length + b->length;
-    char* chars = allocate<char>(length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
-
-    ObjString* result = takeString(chars, length);
+    ObjString* result = makeString(length);
+    memcpy(result->chars, a->chars, a->length);
+    memcpy(result->chars + a->length, b->chars, b->length);
     pop();
     pop();
     push(objVal((Obj*) result));
@@ -390,10 +506,16 @@ static InterpretResult run() {
             case OP_LOOP: {
                 uint16_t offset = readShort();
                 frame->ip -= offset;
+                if (heapDumpRequested) {
+                    serviceHeapDumpRequest();
+                }
                 break;
             }
             case OP_CALL: {
                 int argCount = readByte();
+                if (heapDumpRequested) {
+                    serviceHeapDumpRequest();
+                }
                 if (!callValue(peek(argCount), argCount)){
                     return INTERPRET_RUNTIME_ERROR;
                 }
@@ -423,20 +545,29 @@ static InterpretResult run() {
                 ObjFunction* function = asFunction(readConstant());
                 ObjClosure* closure = newClosure(function);
                 push(objVal((Obj*) closure));
+                // The operand bytes stay in the chunk for the disassembler
+                // and the serializer, but the descriptors were copied into
+                // the function when it was compiled.
+                Upvalue* upvalues = function->upvalues;
                 for (int i = 0; i < closure->upvalueCount; i++){
-                    uint8_t isLocal = readByte();
-                    uint8_t index = readByte();
-                    if (isLocal) {
-                        closure->upvalues[i] = captureUpvalue(frame->slots + index);
+                    if (upvalues[i].isCopy && upvalues[i].isLocal) {
+                        closure->upvalues[i] = frame->slots[upvalues[i].index];
+                    } else if (upvalues[i].isLocal) {
+                        closure->upvalues[i] = objVal((Obj*) captureUpvalue(frame->slots + upvalues[i].index));
                     } else{
-                        closure->upvalues[i] = frame->closure->upvalues[index];
+                        closure->upvalues[i] = frame->closure->upvalues[upvalues[i].index];
                     }
                 }
+                frame->ip += 2 * closure->upvalueCount;
                 break;
             }
             case OP_RETURN: {
                 Value result = pop();
                 closeUpvalues(frame->slots);
+                // Slot 0 of an initializer is the caller's scoped local.
+                while (vm.scopedCount > 0 && vm.scopedSlots[vm.scopedCount - 1] > frame->slots) {
+                    releaseScopedInstance();
+                }
                 vm.frameCount--;
                 if (vm.frameCount == 0) {
                     pop();
@@ -459,7 +590,8 @@ static InterpretResult run() {
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 ObjClass* subclass = asClass(peek(0));
-                tableAddAll(&asClass(superclass)->methods, &subclass->methods);
+                subclass->superclass = asClass(superclass);
+                subclass->initializer = asClass(superclass)->initializer;
                 pop();
                 break;
             }
@@ -532,12 +664,36 @@ static InterpretResult run() {
             }
             case OP_GET_UPVALUE: {
                 uint8_t slot = readByte();
-                push(*frame->closure->upvalues[slot]->location);
+                push(*upvalueBox(frame->closure, slot)->location);
                 break;
             }
             case OP_SET_UPVALUE: {
                 uint8_t slot = readByte();
-                *frame->closure->upvalues[slot]->location = peek(0);
+                *upvalueBox(frame->closure, slot)->location = peek(0);
+                break;
+            }
+            case OP_CALL_SCOPED: {
+                int argCount = readByte();
+                Value callee = peek(argCount);
+                bool called = isClass(callee)
+                    ? callClass(asClass(callee), argCount, true)
+                    : callValue(callee, argCount);
+                if (!called) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                frame = &vm.frames[vm.frameCount - 1];
+                break;
+            }
+            case OP_POP_SCOPED: {
+                if (vm.scopedCount > 0 && vm.scopedSlots[vm.scopedCount - 1] == vm.stackTop - 1) {
+                    releaseScopedInstance();
+                }
+                pop();
+                break;
+            }
+            case OP_GET_CAPTURED: {
+                uint8_t slot = readByte();
+                push(frame->closure->upvalues[slot]);
                 break;
             }
             case OP_CLOSE_UPVALUE: {
@@ -571,16 +727,20 @@ static InterpretResult run() {
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 ObjInstance* instance = asInstance(peek(1));
-                tableSet(&instance->fields, readString(), peek(0));
+                if (tableSet(&instance->fields, readString(), peek(0))
+                        && instance->fields.count > instance->klass->fieldCount) {
+                    instance->klass->fieldCount = instance->fields.count;
+                }
                 Value value = pop();
                 pop();
                 push(value);
                 break;
             }
             case OP_EQUAL: {
-                Value b = pop();
-                Value a = pop();
-                push(boolVal(valuesEqual(a, b)));
+                bool equal = valuesEqual(peek(1), peek(0));
+                pop();
+                pop();
+                push(boolVal(equal));
                 break;
             }
             case OP_GREATER:
@@ -652,36 +812,12 @@ static InterpretResult run() {
     }
 }
 
-InterpretResult interpret(const char* source) {
-    ObjFunction* function = compile(source);
-    if (function == NULL) return INTERPRET_COMPILE_ERROR;
-
+InterpretResult runScript(ObjFunction* function) {
     push(objVal((Obj*) function));
     ObjClosure* closure = newClosure(function);
     pop();
     push(objVal((Obj*) closure));
     call(closure, 0);
-
-    serializationPackage::VMData vmData = serializeVMData(vm, locationOfFunctions, locationsOfNonInstructions, locationOfUpvalues);
-    std::fstream output("VMDataFile.txt", std::ios::out | std::ios::trunc | std::ios::binary);
-    if (!vmData.SerializeToOstream(&output)) {
-      std::cerr << "Failed to write vmdata to file." << std::endl;
-      return INTERPRET_COMPILE_ERROR;
-    }
-
     return run();
-
-    // if (__cplusplus == 201703L) std::cout << "C++17\n";
-    // else if (__cplusplus == 201402L) std::cout << "C++14\n";
-    // else if (__cplusplus == 201103L) std::cout << "C++11\n";
-    // else if (__cplusplus == 199711L) std::cout << "C++98\n";
-    // else std::cout << "pre-standard C++\n";
-    
-
-    // freeChunk(&chunk);
-
-
-    // return result;
-    // return INTERPRET_OK;
 }
 
@@ -12,6 +12,11 @@ typedef struct {
     Value* slots;
 } CallFrame;
 
+typedef enum {
+    ARENA_FALLBACK_GC,
+    ARENA_FALLBACK_FAIL
+} ArenaFallback;
+
 typedef struct {
     CallFrame frames[FRAMES_MAX];
     int frameCount;
@@ -21,12 +26,22 @@ typedef struct {
     Table globals;
     Table strings;
     ObjString* initString;
-    ObjUpvalue* openUpvalues;
+    // The open upvalue for each stack slot, if one has been captured.
+    ObjUpvalue* openUpvalues[STACK_MAX];
+    int openUpvalueCount;
+    // Instances made by OP_CALL_SCOPED live here, in cage memory the collector
+    // doesn't sweep, until the stack slot of the local holding them is popped.
+    ObjInstance* scopedInstances;
+    Value* scopedSlots[STACK_MAX];
+    int scopedCount;
 
     size_t bytesAllocated;
     size_t nextGC;
 
-    Obj* objects;
+    bool arenaMode;
+    size_t arenaLimit;
+    ArenaFallback arenaFallback;
+
     int grayCount;
     int grayCapacity;
     Obj** grayStack;
@@ -38,10 +53,25 @@ typedef enum {
     INTERPRET_RUNTIME_ERROR
 } InterpretResult;
 
+// What the VM calls on outside of its core, all optional. interpret.cpp
+// points them at the compiler and the VMData export; lox_run sets none and
+// links neither.
+typedef struct {
+    // Marks objects that are still being built.
+    void (*markRoots)();
+    // Runs before the collector or freeVM() frees objects.
+    void (*beforeFree)();
+    // Compiles the body of a function with lazy set. Only set with --lazy.
+    bool (*compileFunction)(ObjFunction* function);
+    void (*freeLazyFunction)(ObjFunction* function);
+} VMHooks;
+
 extern VM vm;
+extern VMHooks vmHooks;
 
+void enableArenaMode(size_t limit, ArenaFallback fallback);
 void initVM();
 void freeVM();
-InterpretResult interpret(const char* source);
+InterpretResult runScript(ObjFunction* function);
 void push(Value value);
 Value pop();
\ No newline at end of file